@@ -4,61 +4,268 @@ JsonObject* json_object(JsonField** fields,size_t fields_count);
 void json_put_field(JsonObject* object,JsonField* field);
 
 Arena JSON_arena = {0};
+Arena* json_arena = &JSON_arena;    //where new values, fields and objects are allocated, shared by every thread
+
+Arena* json_set_arena(Arena* arena){
+    Arena* prev = json_arena;
+    json_arena = arena ? arena : &JSON_arena;
+    return prev;
+}
 
 void free_json_data(){
     arena_free(&JSON_arena);
 }
 
+void json_free_arena(Arena* arena){
+    arena_free(arena);
+}
+
+void json_reset_arena(Arena* arena){
+    arena_reset(arena);
+}
+
 void json_array_push(JsonArray* array, JsonValue* value){
     buf_push(array->values, value);
     array->len ++;
 }
 
+void json_array_reserve(JsonArray* array, size_t count){
+    buf_fit(array->values, count);
+}
+
+void json_value_array_push(JsonValue* array,JsonValue* value){
+    assert(array->type == JSON_array && array->len < UINT32_MAX);
+    buf_push(array->values, value);
+    array->len ++;
+}
+
+static JsonValue** json_values_insert(JsonValue** values,size_t index,JsonValue* value){
+    assert(index <= buf_len(values));
+    buf_push(values,value);
+    memmove(values + index + 1,values + index,(buf_len(values) - index - 1)*sizeof(JsonValue*));
+    values[index] = value;
+    return values;
+}
+
+static void json_free_value(JsonValue* value);
+
+static void json_values_erase(JsonValue** values,size_t index){
+    assert(index < buf_len(values));
+    memmove(values + index,values + index + 1,(buf_len(values) - index - 1)*sizeof(JsonValue*));
+    buf__hdr(values)->len--;
+}
+
+void json_array_insert(JsonArray* array,size_t index,JsonValue* value){
+    array->values = json_values_insert(array->values,index,value);
+    array->len ++;
+}
+
+void json_array_erase(JsonArray* array,size_t index){
+    assert(index < array->len);
+    json_free_value(array->values[index]);
+    json_values_erase(array->values,index);
+    array->len --;
+}
+
+void json_value_array_insert(JsonValue* array,size_t index,JsonValue* value){
+    assert(array->type == JSON_array && array->len < UINT32_MAX);
+    array->values = json_values_insert(array->values,index,value);
+    array->len ++;
+}
+
+void json_value_array_erase(JsonValue* array,size_t index){
+    assert(array->type == JSON_array && index < array->len);
+    json_free_value(array->values[index]);
+    json_values_erase(array->values,index);
+    array->len --;
+}
+
+void json_value_set_string(JsonValue* value,JsonString str){
+    assert(str.len <= UINT32_MAX);
+    if (str.str && str.len < JSON_SMALL_STRING){
+        memcpy(value->small,str.str,str.len);
+        value->small[str.len] = 0;
+        value->small_len = (uint8_t)(str.len + 1);
+    }else{
+        value->small_len = 0;
+        value->str = str.str;
+        value->len = (uint32_t)str.len;
+    }
+}
+
+//copies the text into the arena only when it does not fit in the value
+static JsonValue* json_value_text_copy(JsonType type,const char* str,size_t len){
+    JsonValue* value = arena_alloc(json_arena, sizeof(JsonValue));
+    value->type = type;
+    if (len < JSON_SMALL_STRING){
+        json_value_set_string(value,(JsonString){(char*)str,len});
+    }else{
+        json_value_set_string(value,json_string_copy(str,len));
+    }
+    return value;
+}
+
 void* json_alloc(size_t size){
-    return arena_alloc(&JSON_arena,size);
+    return arena_alloc(json_arena,size);
+}
+
+JsonString json_string_copy(const char* str,size_t len){
+    char* copy = arena_alloc(json_arena,len + 1);
+    memcpy(copy,str,len);
+    copy[len] = 0;
+    return (JsonString){copy,len};
 }
 
 JsonValue* json_value_number_float(double val){
-    JsonValue* value = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    JsonValue* value = arena_alloc(json_arena, sizeof(JsonValue));
     value->type = JSON_number_float;
     value->float_number = val;
     return value;
 }
 
 JsonValue* json_value_number_int(int val){
-    JsonValue* value = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    JsonValue* value = arena_alloc(json_arena, sizeof(JsonValue));
     value->type = JSON_number_int;
     value->int_number = val;
     return value;
 }
 
+JsonValue* json_value_number_raw(JsonString text){
+    JsonValue* value = arena_alloc(json_arena, sizeof(JsonValue));
+    value->type = JSON_number_raw;
+    json_value_set_string(value,text);
+    return value;
+}
+
+static bool json_number_text_is_integer(JsonString text){
+    return !memchr(text.str,'.',text.len) && !memchr(text.str,'e',text.len) && !memchr(text.str,'E',text.len);
+}
+
+double json_number_as_double(const JsonValue* value){
+    switch (value->type) {
+        case JSON_number_int:
+            return value->int_number;
+        case JSON_number_float:
+            return value->float_number;
+        case JSON_number_raw:
+            return strtod(json_get_string(value).str,NULL);
+        default:
+            assert(!"not a number");
+            return 0;
+    }
+}
+
+int64_t json_number_as_int64(const JsonValue* value){
+    switch (value->type) {
+        case JSON_number_int:
+            return value->int_number;
+        case JSON_number_float:
+            return (int64_t)value->float_number;
+        case JSON_number_raw: {
+            JsonString text = json_get_string(value);
+            if (json_number_text_is_integer(text)){
+                return strtoll(text.str,NULL,10);
+            }
+            return (int64_t)strtod(text.str,NULL);
+        }
+        default:
+            assert(!"not a number");
+            return 0;
+    }
+}
+
+int json_number_as_int(const JsonValue* value){
+    return (int)json_number_as_int64(value);
+}
+
+static JsonValue* json_value_array_packed(JsonType type,const void* values,size_t count){
+    JsonValue* val = arena_alloc(json_arena, sizeof(JsonValue));
+    assert(count <= UINT32_MAX);
+    val->type = type;
+    val->len = (uint32_t)count;
+    val->floats = NULL;
+    if (count){
+        void* data = arena_alloc(json_arena,count*sizeof(double));
+        memcpy(data,values,count*sizeof(double));
+        val->floats = data;
+    }
+    return val;
+}
+
+JsonValue* json_value_array_float(const double* values,size_t count){
+    return json_value_array_packed(JSON_array_float,values,count);
+}
+
+JsonValue* json_value_array_int(const int64_t* values,size_t count){
+    return json_value_array_packed(JSON_array_int,values,count);
+}
+
+double json_array_float_at(const JsonValue* array,size_t i){
+    assert(i < array->len);
+    switch (array->type) {
+        case JSON_array_float:
+            return array->floats[i];
+        case JSON_array_int:
+            return (double)array->ints[i];
+        default:
+            return json_number_as_double(array->values[i]);
+    }
+}
+
+int64_t json_array_int_at(const JsonValue* array,size_t i){
+    assert(i < array->len);
+    switch (array->type) {
+        case JSON_array_float:
+            return (int64_t)array->floats[i];
+        case JSON_array_int:
+            return array->ints[i];
+        default:
+            return json_number_as_int64(array->values[i]);
+    }
+}
+
 JsonValue* json_value_string(JsonString val){
-    JsonValue* value = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    JsonValue* value = arena_alloc(json_arena, sizeof(JsonValue));
     value->type = JSON_string;
-    value->string = val;
+    json_value_set_string(value,val);
     return value;
 }
 
+JsonValue* json_value_string_n(const char* str,size_t len){
+    return json_value_text_copy(JSON_string,str,len);
+}
+
 JsonValue* json_value_boolean(bool value){
-    JsonValue* val = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    JsonValue* val = arena_alloc(json_arena, sizeof(JsonValue));
     val->type = JSON_bool;
     val->boolean = value;
     return val;
 }
 
 JsonValue* json_value_array(JsonValue** values, size_t count){
-    JsonValue* val = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    return json_value_array_hinted(values,count,NULL);
+}
+
+JsonValue* json_value_array_hinted(JsonValue** values,size_t count,const JsonSizeHint* hint){
+    JsonValue* val = arena_alloc(json_arena, sizeof(JsonValue));
+    size_t capacity = hint ? MAX(count,hint->values_count) : count;
+    assert(count <= UINT32_MAX);
     val->type = JSON_array;
-    val->array.values = NULL;
-    val->array.len = 0;
-    for (JsonValue** value = values; value != values + count;value++){
-        json_array_push(&val->array,*value);
+    val->values = NULL;
+    val->len = 0;
+    if (capacity){
+        buf_fit(val->values,capacity);
+    }
+    if (count){
+        memcpy(val->values,values,count*sizeof(JsonValue*));
+        buf__hdr(val->values)->len = count;
+        val->len = (uint32_t)count;
     }
     return val;
 }
 
 JsonValue* json_value_object(JsonObject* value){
-    JsonValue* val = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    JsonValue* val = arena_alloc(json_arena, sizeof(JsonValue));
     val->type = JSON_object;
     if(value){
         val->object = value;
@@ -69,51 +276,159 @@ JsonValue* json_value_object(JsonObject* value){
 }
 
 JsonValue* json_value_null(){
-    JsonValue* val = arena_alloc(&JSON_arena, sizeof(JsonValue));
+    JsonValue* val = arena_alloc(json_arena, sizeof(JsonValue));
     val->type = JSON_null;
     return val;
 }
 
 JsonField* json_field(const char* key,JsonValue* value){
-    JsonField* f = arena_alloc(&JSON_arena,sizeof(JsonField));
+    JsonField* f = arena_alloc(json_arena,sizeof(JsonField));
     f->key.str = key;
     f->key.len = strlen(key);
     f->value = value;
+    f->quoted_key = (JsonString){0};
     return f;
 }
 
 JsonObject* json_object(JsonField** fields,size_t fields_count){
-    JsonObject* obj = arena_calloc(&JSON_arena,1,sizeof(JsonObject));
-    obj->fields_map = arena_calloc(&JSON_arena,1,sizeof(Map));
+    return json_object_hinted(fields,fields_count,NULL);
+}
+
+JsonObject* json_object_hinted(JsonField** fields,size_t fields_count,const JsonSizeHint* hint){
+    JsonObject* obj = arena_calloc(json_arena,1,sizeof(JsonObject));
+    size_t capacity = hint ? MAX(fields_count,hint->fields_count) : fields_count;
+    obj->fields_map = arena_calloc(json_arena,1,sizeof(Map));
+    if (capacity){
+        json_object_reserve(obj,capacity);
+    }
     for (JsonField** field = fields; field && field != fields+fields_count; field++){
         json_put_field(obj,*field);
     }
     return obj;
 }
 
+JsonObject* json_object_hashed(JsonField** fields,const uint64_t* hashes,size_t fields_count){
+    JsonObject* obj = json_object(NULL,0);
+    if (fields_count){
+        json_object_reserve(obj,fields_count);
+    }
+    for (size_t i = 0; i < fields_count; i++){
+        json_put_field_hashed(obj,fields[i],hashes[i]);
+    }
+    return obj;
+}
+
+void json_object_reserve(JsonObject* obj,size_t fields_count){
+    json_object_unshare(obj);
+    buf_fit(obj->fields,fields_count);
+    map_reserve(obj->fields_map,fields_count);
+}
+
+void json_size_hint_update(JsonSizeHint* hint,const JsonValue* value){
+    if (value->type == JSON_object){
+        hint->fields_count = MAX(hint->fields_count,value->object->fields_count);
+    }else if (value->type == JSON_array){
+        hint->values_count = MAX(hint->values_count,value->len);
+    }
+}
+
+uint64_t json_key_hash(const char* key,size_t len){
+    return str_hash(key,len);
+}
+
+bool json_set_hash_seed(uint64_t seed){
+    return str_hash_init(seed);
+}
+
 void json_put_field(JsonObject* object,JsonField* field){
-    uint64_t hash = str_hash(field->key.str,field->key.len);
-    JsonField* hashed = map_get_hashed(object->fields_map,(void*)hash,hash);
-    field->next = hashed;
-    map_put_hashed(object->fields_map,(void*)hash,field,hash);
+    json_put_field_hashed(object,field,str_hash(field->key.str,field->key.len));
+}
+
+static bool json_field_match(const void* val,const void* ctx){
+    const JsonField* field = val;
+    const JsonString* key = ctx;
+    return field->key.len == key->len && !memcmp(field->key.str,key->str,key->len);
+}
+
+void json_put_field_hashed(JsonObject* object,JsonField* field,uint64_t hash){
+    //the index keeps the latest field for a key, fields keeps them all
+    json_object_unshare(object);
+    JsonField** indexed = (JsonField**)map_find_hashed(object->fields_map,hash,json_field_match,&field->key);
+    if (indexed){
+        *indexed = field;
+    }else{
+        map_insert_hashed(object->fields_map,hash,field);
+    }
     buf_push(object->fields,field);
     object->fields_count ++;
 }
 
+// Lookup in an object with fields, without touching it
+static JsonField* json_find_field(JsonObject* obj,const char* key){
+    assert(!obj->shape);
+    JsonString key_str = {(char*)key,strlen(key)};
+    uint64_t hash = str_hash(key_str.str,key_str.len);
+    JsonField** field = (JsonField**)map_find_hashed(obj->fields_map,hash,json_field_match,&key_str);
+    return field ? *field : NULL;
+}
+
 JsonField* json_get_field(JsonObject* obj,const char* key){
-    uint64_t hash = str_hash(key,strlen(key));
-    JsonField* hashed = map_get_hashed(obj->fields_map,(void*)hash,hash);
-    if(!hashed) return NULL;
-    for (JsonField* field = hashed; field; field = field->next){
-        if(!strcmp(field->key.str,key)){
-            return field;
+    if (obj->shape){
+        //a miss leaves the object shared, only a field handed out for editing needs one
+        if (json_shape_slot(obj->shape,key,strlen(key)) == obj->shape->count){
+            return NULL;
+        }
+        json_object_unshare(obj);
+    }
+    return json_find_field(obj,key);
+}
+
+JsonField* json_set_field(JsonObject* obj,const char* key,JsonValue* value){
+    json_object_unshare(obj);
+    JsonString key_str = {(char*)key,strlen(key)};
+    uint64_t hash = str_hash(key_str.str,key_str.len);
+    JsonField** indexed = (JsonField**)map_find_hashed(obj->fields_map,hash,json_field_match,&key_str);
+    if (indexed){
+        JsonValue* old = (*indexed)->value;
+        if (old && old != value){
+            json_free_value(old);
+        }
+        (*indexed)->value = value;
+        return *indexed;
+    }
+    JsonField* field = json_field(key,value);
+    json_put_field_hashed(obj,field,hash);
+    return field;
+}
+
+// Removes every field with key, freeing their values unless other objects share them
+static bool json_remove_fields(JsonObject* obj,const char* key,bool free_values){
+    json_object_unshare(obj);
+    JsonString key_str = {(char*)key,strlen(key)};
+    uint64_t hash = str_hash(key_str.str,key_str.len);
+    if (!map_remove_hashed(obj->fields_map,hash,json_field_match,&key_str)){
+        return false;
+    }
+    //the index only held the latest field, earlier duplicates go as well
+    size_t kept = 0;
+    for (size_t i = 0; i < obj->fields_count; i++){
+        if (!json_field_match(obj->fields[i],&key_str)){
+            obj->fields[kept++] = obj->fields[i];
+        }else if (free_values && obj->fields[i]->value){
+            json_free_value(obj->fields[i]->value);
         }
     }
-    return NULL;
+    buf__hdr(obj->fields)->len = kept;
+    obj->fields_count = kept;
+    return true;
+}
+
+bool json_remove_field(JsonObject* obj,const char* key){
+    return json_remove_fields(obj,key,true);
 }
 
 void json_free_object(JsonObject* obj);
-static void json_free_array(JsonArray array);
+static void json_free_array(JsonValue* array);
 
 static void json_free_value(JsonValue* value){
     switch (value->type) {
@@ -121,18 +436,18 @@ static void json_free_value(JsonValue* value){
             json_free_object(value->object);
             break;
         case JSON_array:
-            json_free_array(value->array);
+            json_free_array(value);
             break;
         default:
             break;
     }
 }
 
-static void json_free_array(JsonArray array){
-    for (JsonValue** val = array.values; val != buf_end(array.values); val++){
+static void json_free_array(JsonValue* array){
+    for (JsonValue** val = array->values; val != buf_end(array->values); val++){
         json_free_value(*val);
     }
-    buf_free(array.values);
+    buf_free(array->values);
 }
 
 static void json_free_field(JsonField* field){
@@ -140,9 +455,164 @@ static void json_free_field(JsonField* field){
 }
 
 void json_free_object(JsonObject* obj){
+    if (obj->shape){
+        for (size_t i = 0; i < obj->fields_count; i++){
+            json_free_value(obj->values[i]);
+        }
+    }
     for (JsonField** field = obj->fields; field != buf_end(obj->fields); field++){
         json_free_field(*field);
     }
     buf_free(obj->fields);
-    free(obj->fields_map->entries);
-}
\ No newline at end of file
+    if (obj->fields_map){
+        free(obj->fields_map->entries);
+        obj->fields_map->entries = NULL;
+    }
+    if (obj->arena){
+        arena_free(obj->arena);
+        free(obj->arena);
+        obj->arena = NULL;
+    }
+}
+
+// Deep clone: the copy is laid out depth-first in a single arena block, with
+// each object's fields and each array's values stored contiguously. Shaped
+// objects come out with fields, so the copy references nothing outside it.
+
+#define arena_size(size) ALIGN_UP((size),ARENA_ALIGNMENT)
+
+static size_t json_object_footprint(JsonObject* obj);
+
+static size_t json_value_footprint(JsonValue* value){
+    size_t size = arena_size(sizeof(JsonValue));
+    switch (value->type) {
+        case JSON_string:
+        case JSON_number_raw:
+            size += !value->small_len && value->str ? arena_size(value->len + 1) : 0;
+            break;
+        case JSON_array:
+            if (value->len){
+                size += arena_size(offsetof(BufHdr,buf) + value->len*sizeof(JsonValue*));
+                for (size_t i = 0; i < value->len; i++){
+                    size += json_value_footprint(value->values[i]);
+                }
+            }
+            break;
+        case JSON_array_float:
+        case JSON_array_int:
+            size += arena_size(value->len*sizeof(double));
+            break;
+        case JSON_object:
+            size += arena_size(sizeof(JsonObject)) + json_object_footprint(value->object);
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+static size_t json_object_footprint(JsonObject* obj){
+    size_t size = arena_size(sizeof(Map));
+    if (obj->fields_count){
+        size += arena_size(offsetof(BufHdr,buf) + obj->fields_count*sizeof(JsonField*));
+        size += arena_size(obj->fields_count*sizeof(JsonField));
+        for (size_t i = 0; i < obj->fields_count; i++){
+            JsonValue* value = json_object_value(obj,i);
+            size += arena_size(json_object_key(obj,i).len + 1);
+            size += value ? json_value_footprint(value) : 0;
+        }
+    }
+    return size;
+}
+
+static JsonString json_clone_string(Arena* arena,JsonString str){
+    if (!str.str){
+        return str;
+    }
+    char* copy = arena_alloc(arena,str.len + 1);
+    memcpy(copy,str.str,str.len);
+    copy[str.len] = 0;
+    return (JsonString){copy,str.len};
+}
+
+static void json_clone_object_into(Arena* arena,JsonObject* dst,JsonObject* src);
+
+static JsonValue* json_clone_value(Arena* arena,JsonValue* src){
+    JsonValue* dst = arena_alloc(arena,sizeof(JsonValue));
+    *dst = *src;
+    switch (src->type) {
+        case JSON_string:
+        case JSON_number_raw:
+            if (!src->small_len){
+                dst->str = json_clone_string(arena,json_get_string(src)).str;
+            }
+            break;
+        case JSON_array:
+            dst->values = NULL;
+            if (src->len){
+                dst->values = arena_buf(arena,src->len,sizeof(JsonValue*));
+                buf__hdr(dst->values)->len = src->len;
+                for (size_t i = 0; i < src->len; i++){
+                    dst->values[i] = json_clone_value(arena,src->values[i]);
+                }
+            }
+            break;
+        case JSON_array_float:
+        case JSON_array_int:
+            if (src->len){
+                dst->floats = arena_alloc(arena,src->len*sizeof(double));
+                memcpy(dst->floats,src->floats,src->len*sizeof(double));
+            }
+            break;
+        case JSON_object:
+            dst->object = arena_alloc(arena,sizeof(JsonObject));
+            json_clone_object_into(arena,dst->object,src->object);
+            break;
+        default:
+            break;
+    }
+    return dst;
+}
+
+static void json_clone_object_into(Arena* arena,JsonObject* dst,JsonObject* src){
+    size_t count = src->fields_count;
+    dst->format_print = src->format_print;
+    dst->fields = NULL;
+    dst->fields_count = 0;
+    dst->arena = NULL;
+    //shaped objects are copied with their own keys, so the copy does not depend on the shapes
+    dst->shape = NULL;
+    dst->values = NULL;
+    dst->values_arena = NULL;
+    dst->fields_map = arena_calloc(arena,1,sizeof(Map));
+    if (!count){
+        return;
+    }
+    dst->fields = arena_buf(arena,count,sizeof(JsonField*));
+    JsonField* fields = arena_alloc(arena,count*sizeof(JsonField));
+    map_reserve(dst->fields_map,count);
+    for (size_t i = 0; i < count; i++){
+        JsonValue* value = json_object_value(src,i);
+        fields[i].key = json_clone_string(arena,json_object_key(src,i));
+        fields[i].value = value ? json_clone_value(arena,value) : NULL;
+        fields[i].quoted_key = (JsonString){0};
+        json_put_field(dst,fields + i);
+    }
+}
+
+JsonObject* json_clone(JsonObject* doc,Arena* dst_arena){
+    assert(doc);
+    Arena* arena = dst_arena ? dst_arena : json_arena;
+    arena_reserve(arena,arena_size(sizeof(JsonObject)) + json_object_footprint(doc));
+    JsonObject* copy = arena_alloc(arena,sizeof(JsonObject));
+    json_clone_object_into(arena,copy,doc);
+    return copy;
+}
+
+void json_compact(JsonObject* doc){
+    Arena* arena = xcalloc(1,sizeof(Arena));
+    JsonObject* copy = json_clone(doc,arena);
+    json_free_object(doc);
+    *doc = *copy;
+    doc->arena = arena;
+}
@@ -1,3 +1,6 @@
+#ifndef JSON_PARSER_JSON_H
+#define JSON_PARSER_JSON_H
+
 typedef enum JsonType{
     JSON_number_int,    //int
     JSON_number_float,  //double
@@ -5,7 +8,10 @@ typedef enum JsonType{
     JSON_bool,          //std bool
     JSON_array,         //array of JSON values
     JSON_object,        //JSON object
-    JSON_null           //NULL
+    JSON_null,          //NULL
+    JSON_number_raw,    //number kept as its source text, see json_set_lazy_numbers
+    JSON_array_float,   //array of numbers packed as double[], see json_set_packed_arrays
+    JSON_array_int      //array of integers packed as int64_t[]
 }JsonType;
 
 typedef struct JsonObject JsonObject;
@@ -17,53 +23,209 @@ typedef struct JsonString{
 }JsonString;
 
 typedef struct JsonArray{
-    BUF(JsonValue** values);
+    union{
+        BUF(JsonValue** values);    //JSON_array
+        double* floats;             //JSON_array_float, in the arena
+        int64_t* ints;              //JSON_array_int, in the arena
+    };
     size_t len;
 }JsonArray;
 
+#define JSON_SMALL_STRING 14    //bytes of string stored inside a JsonValue, NUL included
+
+// 16 bytes: a one-byte tag, a 32-bit length and an 8-byte payload, or the tag
+// followed by a short string stored in place
 struct JsonValue{
-    JsonType type;
     union{
-        double float_number;
-        int int_number;
-        JsonString string;
-        bool boolean;
-        JsonArray array;
-        JsonObject* object;
+        struct{
+            uint8_t type;           //JsonType
+            uint8_t small_len;      //length + 1 of a string kept in small, 0 when it is in str
+            uint16_t reserved;
+            uint32_t len;           //of str and of arrays
+            union{
+                double float_number;
+                int int_number;
+                bool boolean;
+                char* str;                  //JSON_string or JSON_number_raw text, NUL terminated
+                BUF(JsonValue** values);    //JSON_array
+                double* floats;             //JSON_array_float, in the arena
+                int64_t* ints;              //JSON_array_int, in the arena
+                JsonObject* object;
+            };
+        };
+        struct{
+            uint8_t small_header[2];
+            char small[JSON_SMALL_STRING];
+        };
     };
 };
 
 typedef struct JsonField{
     JsonString key;
     JsonValue* value;
-    struct JsonField* next;//for hash map
+    JsonString quoted_key;  //escaped "key": filled by json_quote_keys, empty otherwise
 }JsonField;
 
+// Shapes: the key list shared by every object parsed with the same keys in the
+// same order, see json_set_shared_shapes. A shape is a node in a tree of key
+// transitions rooted at the empty shape, and is never freed before json_free_shapes.
+typedef struct JsonShape JsonShape;
+
+struct JsonShape{
+    size_t count;               //keys, duplicates included
+    JsonString* keys;           //in slot order, filled once an object ends with this shape
+    JsonString* quoted_keys;    //escaped "key": filled by json_quote_keys, NULL otherwise
+    uint32_t* index;            //slot + 1 by key hash, open addressing, later duplicates win
+    size_t index_cap;
+    uint64_t hash_seed;
+    JsonShape* parent;
+    JsonString key;             //the key added to parent
+    BUF(JsonShape** transitions);
+};
+
 struct JsonObject{
     bool format_print;
     BUF(JsonField** fields);
     size_t fields_count;
     Map* fields_map;
+    Arena* arena;   //storage owned by the object after json_compact, NULL otherwise
+    JsonShape* shape;       //set when the object holds only values, fields and fields_map are NULL then
+    JsonValue** values;     //one per shape key, in the arena
+    Arena* values_arena;    //arena holding values, where json_object_unshare puts the fields
 };
 
 void free_json_data();
 
+void json_free_arena(Arena* arena);
+
+// Drops everything allocated in arena but keeps its memory for the next document;
+// large blocks give their pages back to the OS until they are used again.
+// Objects and arrays keep their fields, index and elements on the heap, so
+// json_free_object every root built in arena first, as JSON::Document does.
+void json_reset_arena(Arena* arena);
+
+// Appends field: a key already present keeps its earlier fields, and lookups find the latest
 void json_put_field(JsonObject* object,JsonField* field);
 
+void json_put_field_hashed(JsonObject* object,JsonField* field,uint64_t hash);
+
+uint64_t json_key_hash(const char* key,size_t len);
+
+// Seeds the key hash; returns false and keeps the seed once anything has been
+// hashed, since object indexes and cached binding hashes depend on it
+bool json_set_hash_seed(uint64_t seed);
+
+void json_object_reserve(JsonObject* obj,size_t fields_count);
+
+// Sizes learned from earlier documents with the same layout, so builders for
+// the next one allocate their fields, index and elements once
+typedef struct JsonSizeHint{
+    size_t fields_count;    //largest object seen
+    size_t values_count;    //largest array seen
+}JsonSizeHint;
+
+// Grows hint to cover value when it is an object or an array
+void json_size_hint_update(JsonSizeHint* hint,const JsonValue* value);
+
+// Field with key, to read or edit in place; a shaped object that has the key is
+// unshared first, so look values up with json_get when only reading
 JsonField* json_get_field(JsonObject* obj,const char* key);
 
+// Replaces the value of the field json_get_field would find, freeing the old one
+// as json_free_object would, or appends a field when the key is new; key is not
+// copied, as with json_field
+JsonField* json_set_field(JsonObject* obj,const char* key,JsonValue* value);
+
+// Removes every field with key, keeping the order of the rest and freeing their
+// values; false when absent
+bool json_remove_field(JsonObject* obj,const char* key);
+
+JsonValue* json_get(JsonObject* obj,const char* key);
+
+// Key and value of the i-th field in either layout
+JsonString json_object_key(const JsonObject* obj,size_t i);
+
+JsonValue* json_object_value(const JsonObject* obj,size_t i);
+
+// Gives a shaped object its own fields and index, as any object built by hand,
+// allocated in its values_arena
+void json_object_unshare(JsonObject* obj);
+
+// Slot of key in the shape, shape->count when absent
+size_t json_shape_slot(const JsonShape* shape,const char* key,size_t len);
+
+// Bumped by json_free_shapes, so a JsonShape* cached from an older generation is not trusted
+extern uint64_t json_shape_generation;
+
+void json_free_shapes();
+
+void json_quote_keys(JsonObject* obj);
+
 inline JsonString json_string(const char* str){
     return (JsonString){str,strlen(str)};
 }
 
+// Text of a JSON_string or JSON_number_raw value, wherever it is stored
+inline JsonString json_get_string(const JsonValue* value){
+    if (value->small_len){
+        return (JsonString){(char*)value->small,value->small_len - 1u};
+    }
+    return (JsonString){value->str,value->len};
+}
+
+// Elements of a JSON_array; packed arrays have none, read their floats or ints
+inline JsonArray json_get_array(const JsonValue* value){
+    assert(value->type == JSON_array);
+    JsonArray array;
+    array.values = value->values;
+    array.len = value->len;
+    return array;
+}
+
+void json_value_set_string(JsonValue* value,JsonString str);
+
 void json_array_push(JsonArray* array, JsonValue* value);
 
+void json_value_array_push(JsonValue* array,JsonValue* value);
+
+// Shift the elements after index; index may be the length to insert at the end
+void json_array_insert(JsonArray* array,size_t index,JsonValue* value);
+
+// Removes the element at index and frees it as json_free_object would
+void json_array_erase(JsonArray* array,size_t index);
+
+void json_value_array_insert(JsonValue* array,size_t index,JsonValue* value);
+
+void json_value_array_erase(JsonValue* array,size_t index);
+
+void json_array_reserve(JsonArray* array, size_t count);
+
 JsonValue* json_value_number_float(double val);
 
 JsonValue* json_value_number_int(int val);
 
+JsonValue* json_value_number_raw(JsonString text);
+
+JsonValue* json_value_array_float(const double* values,size_t count);
+
+JsonValue* json_value_array_int(const int64_t* values,size_t count);
+
+// Element i of a packed or boxed array of numbers
+double json_array_float_at(const JsonValue* array,size_t i);
+
+int64_t json_array_int_at(const JsonValue* array,size_t i);
+
+// Reads any number value, converting JSON_number_raw text on every call
+double json_number_as_double(const JsonValue* value);
+
+int64_t json_number_as_int64(const JsonValue* value);
+
+int json_number_as_int(const JsonValue* value);
+
 JsonValue* json_value_string(JsonString val);
 
+JsonValue* json_value_string_n(const char* str,size_t len);
+
 JsonValue* json_value_boolean(bool value);
 
 JsonValue* json_value_array(JsonValue** values, size_t count);
@@ -76,12 +238,386 @@ JsonField* json_field(const char* key,JsonValue* value);
 
 JsonObject* json_object(JsonField** fields,size_t fields_count);
 
+JsonObject* json_object_hashed(JsonField** fields,const uint64_t* hashes,size_t fields_count);
+
+// json_object and json_value_array reserving at least what hint has seen; hint may be NULL
+JsonObject* json_object_hinted(JsonField** fields,size_t fields_count,const JsonSizeHint* hint);
+
+JsonValue* json_value_array_hinted(JsonValue** values,size_t count,const JsonSizeHint* hint);
+
+#define JSON_MAX_DEPTH_DEFAULT 512
+
+typedef enum JsonErrorCode{
+    JSON_OK,
+    JSON_ERROR_UNEXPECTED_TOKEN,    //grammar violation
+    JSON_ERROR_UNEXPECTED_EOF,      //input ends inside a value
+    JSON_ERROR_STRING,              //bad escape, control character or surrogate
+    JSON_ERROR_UTF8,                //malformed UTF-8 in a string
+    JSON_ERROR_NUMBER,              //malformed or out of range number
+    JSON_ERROR_DEPTH,               //nesting deeper than json_max_depth
+    JSON_ERROR_TRAILING,            //content after the top-level value
+    JSON_ERROR_TYPE,                //json_decode: value does not fit the bound field
+}JsonErrorCode;
+
+typedef struct JsonError{
+    JsonErrorCode code;
+    size_t offset;      //bytes from the start of the input
+    int line;           //1-based
+    int column;         //1-based, in bytes
+    char message[128];
+}JsonError;
+
+// Parsers and validators read exactly len bytes of str, which need not be
+// NUL terminated. A NUL before len is an error.
+// On failure they return NULL/false and fill *error when it is not NULL.
+
 JsonObject* json_parse(char* str);
 
+JsonObject* json_parse_n(const char* str,size_t len,JsonError* error);
+
+bool json_validate(const char* str,size_t len,JsonError* error);
+
+void json_set_max_depth(size_t depth);
+
+// When set, json_parse stores numbers as JSON_number_raw: the source text is
+// kept and only converted when read, and printing writes it back verbatim
+void json_set_lazy_numbers(bool lazy);
+
+// When set, json_parse stores non-empty arrays holding only numbers as
+// JSON_array_int (all integers) or JSON_array_float, with no JsonValue per
+// element. Ignored while lazy numbers are on.
+void json_set_packed_arrays(bool packed);
+
+// When set, json_parse stores each object as a shared JsonShape plus an array
+// of values instead of its own fields and index. Read such objects with
+// json_get or json_object_key/json_object_value, which never write to them;
+// json_get_field on a present key and every edit unshare them first.
+void json_set_shared_shapes(bool shared);
+
 void* json_alloc(size_t size);
 
-char* json_stringify(JsonObject* object);
+// Arena for everything allocated from now on, NULL for the default; returns the
+// previous one. The setting is process-wide, like the parser's state, so parse
+// and build documents from one thread at a time.
+Arena* json_set_arena(Arena* arena);
+
+JsonString json_string_copy(const char* str,size_t len);
+
+typedef enum JsonFormatMode{
+    JSON_FORMAT_COMPACT,    //no whitespace at all
+    JSON_FORMAT_PRETTY,     //one field per line, arrays of scalars on one line
+    JSON_FORMAT_EXPANDED,   //one field or array element per line
+}JsonFormatMode;
+
+typedef struct JsonFormat{
+    JsonFormatMode mode;
+    int indent_width;       //indent characters per nesting level
+    char indent_char;       //' ' or '\t'
+    bool sort_keys;         //print fields ordered by key instead of insertion
+}JsonFormat;
+
+extern const JsonFormat json_format_compact;
+extern const JsonFormat json_format_pretty;
+
+// NUL-terminated BUF like json_encode's, release it with json_buffer_free
+BUF(char*) json_stringify(JsonObject* object);
+
+BUF(char*) json_stringify_format(BUF(char* buffer),JsonObject* object,const JsonFormat* format);
 
 void json_free_object(JsonObject* obj);
 
+// Deep copy of doc into dst_arena, or the current arena when NULL, sharing
+// nothing with doc: shaped objects are copied with fields and their own keys
+JsonObject* json_clone(JsonObject* doc,Arena* dst_arena);
+
+// Moves doc into one arena block that the object owns and json_free_object
+// releases. Only the heap buffers of the old tree are freed: the JsonObject doc
+// points at and the old values, fields and keys stay in the arena they were
+// allocated in, which may hold other documents, until that arena is freed or reset.
+void json_compact(JsonObject* doc);
+
 void json_fprintf(FILE* stream,JsonObject* obj);
+
+void json_fprintf_format(FILE* stream,JsonObject* obj,const JsonFormat* format);
+
+// Snapshot: relocatable, mmap-able binary image of a parsed object.
+// All references inside the image are self-relative offsets, so it can be
+// mapped at any address and queried without parsing or allocating.
+
+#define JSON_SNAPSHOT_MAGIC 0x50414e534e4f534aull //"JSONSNAP"
+#define JSON_SNAPSHOT_VERSION 2
+
+typedef struct JsonSnapValue{
+    uint32_t type;      //JsonType
+    uint32_t reserved;
+    union{
+        double float_number;
+        int64_t int_number;
+        bool boolean;
+        int64_t offset;  //payload of strings, arrays and objects, relative to this node
+    };
+}JsonSnapValue;
+
+typedef struct JsonSnapString{
+    uint64_t len;
+    char str[];
+}JsonSnapString;
+
+typedef struct JsonSnapArray{
+    uint64_t len;
+    JsonSnapValue values[];
+}JsonSnapArray;
+
+typedef struct JsonSnapField{
+    uint64_t hash;      //str_hash of the key
+    int64_t key;        //JsonSnapString, relative to this field
+    JsonSnapValue value;
+}JsonSnapField;
+
+typedef struct JsonSnapObject{
+    uint64_t fields_count;
+    uint64_t index_cap;
+    uint64_t hash_seed; //seed the field hashes were computed with
+    JsonSnapField fields[];
+    //followed by uint32_t index[index_cap]: field position + 1, 0 for an empty slot
+}JsonSnapObject;
+
+typedef struct JsonSnapHeader{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t size;
+    JsonSnapValue root;
+}JsonSnapHeader;
+
+typedef struct JsonSnapshot{
+    const char* data;
+    size_t size;
+    bool mapped;
+}JsonSnapshot;
+
+BUF(char*) json_snapshot_write(JsonObject* obj);
+
+bool json_snapshot_save(JsonObject* obj,const char* path);
+
+// Checks every offset and length in the image once; data is NULL when the
+// image is not a well-formed snapshot, and the accessors need no checks after
+JsonSnapshot json_snapshot_open(const void* data,size_t size);
+
+JsonSnapshot json_snapshot_load(const char* path);
+
+void json_snapshot_close(JsonSnapshot* snapshot);
+
+const JsonSnapObject* json_snapshot_root(JsonSnapshot snapshot);
+
+JsonString json_snap_string(const JsonSnapValue* value);
+
+const JsonSnapArray* json_snap_array(const JsonSnapValue* value);
+
+const JsonSnapObject* json_snap_object(const JsonSnapValue* value);
+
+JsonString json_snap_key(const JsonSnapField* field);
+
+const JsonSnapField* json_snap_get_field(const JsonSnapObject* obj,const char* key);
+
+// Bindings: field descriptors of a native struct for json_decode
+
+typedef struct JsonBinding JsonBinding;
+
+typedef struct JsonBindField{
+    const char* key;
+    JsonType type;          //int, double, bool, JsonString or a nested struct
+    size_t offset;          //of the member inside the struct
+    JsonBinding* binding;   //JSON_object members
+    void (*set_str)(void* member,const char* str,size_t len); //optional for JSON_string members
+    JsonString (*get_str)(const void* member);                //optional for JSON_string members
+    const char* quoted_key; //"\"key\":", generated by json_binding_init when NULL
+    size_t quoted_key_len;  //filled by json_binding_init
+    size_t key_len;
+    uint64_t hash;
+}JsonBindField;
+
+struct JsonBinding{
+    JsonBindField* fields;
+    size_t fields_count;
+    bool initialized;
+};
+
+void json_binding_init(JsonBinding* binding);
+
+// Reads len bytes of str into dst as json_parse_n would; JSON_ERROR_TYPE when a
+// value does not fit its field. Fields missing from the input keep their value.
+bool json_decode(const char* str,size_t len,void* dst,JsonBinding* binding,JsonError* error);
+
+// Appends src to buffer; NULL, with buffer freed, when a double is NaN or infinite
+BUF(char*) json_encode(BUF(char*) buffer,const void* src,JsonBinding* binding);
+
+size_t json_buffer_len(const char* buffer);
+
+void json_buffer_clear(char* buffer);
+
+void json_buffer_free(char* buffer);
+
+// Columns: struct-of-arrays extraction from an array of records. Both the tree
+// and the token path read a cell the same way: int columns take any number with
+// an integral value in int64_t range, and a key repeated in a record counts
+// with its last value, as json_get finds it.
+
+typedef struct JsonColumnSpec{
+    const char* key;
+    JsonType type;          //JSON_number_int, JSON_number_float, JSON_bool or JSON_string
+}JsonColumnSpec;
+
+typedef struct JsonColumn{
+    const char* key;
+    JsonType type;
+    size_t key_len;
+    uint64_t hash;
+    union{
+        BUF(int64_t* ints);
+        BUF(double* floats);
+        BUF(uint8_t* bools);
+        BUF(size_t* offsets);   //JSON_string: rows + 1 offsets into data
+    };
+    BUF(char* data);            //JSON_string: bytes of every row, back to back
+    BUF(uint8_t* validity);     //bit per row, LSB first: set when present with the expected type
+}JsonColumn;
+
+typedef struct JsonColumns{
+    JsonColumn* columns;
+    size_t columns_count;
+    size_t rows;
+    BUF(uint32_t* key_hints);   //column + 1 matched by the n-th key of the previous record
+}JsonColumns;
+
+void json_columns_init(JsonColumns* cols,const JsonColumnSpec* specs,size_t count);
+
+void json_columns_clear(JsonColumns* cols);
+
+void json_columns_free(JsonColumns* cols);
+
+void json_columns_prepare(JsonColumns* cols,const JsonValue* records);
+
+void json_columns_fill(JsonColumns* cols,const JsonValue* records,size_t begin,size_t end);
+
+bool json_columns_decode(JsonColumns* cols,const char* str,size_t len,JsonError* error);
+
+bool json_column_valid(const JsonColumn* col,size_t row);
+
+size_t json_column_null_count(const JsonColumn* col,size_t rows);
+
+JsonString json_column_string(const JsonColumn* col,size_t row);
+
+// Filters: predicates evaluated over NDJSON records while they are lexed
+
+#define JSON_FILTER_MAX_TERMS 64
+
+typedef enum JsonFilterOp{
+    JSON_FILTER_EQ,
+    JSON_FILTER_NE,
+    JSON_FILTER_LT,
+    JSON_FILTER_LE,
+    JSON_FILTER_GT,
+    JSON_FILTER_GE,
+}JsonFilterOp;
+
+typedef struct JsonFilterTerm{
+    JsonString key;
+    JsonFilterOp op;
+    JsonType type;          //of the literal: JSON_number_float, JSON_string, JSON_bool or JSON_null
+    union{
+        double number;
+        JsonString string;
+        bool boolean;
+    };
+}JsonFilterTerm;
+
+typedef struct JsonFilter{
+    BUF(JsonFilterTerm* terms);     //all of them must hold
+    size_t records;
+    size_t matches;
+    size_t malformed;
+}JsonFilter;
+
+typedef bool (*JsonFilterFunc)(const char* record,size_t len,void* user); //return false to stop
+
+bool json_filter_compile(JsonFilter* filter,const char* expr,JsonError* error);
+
+void json_filter_free(JsonFilter* filter);
+
+bool json_filter_match(JsonFilter* filter,const char* record,size_t len);
+
+size_t json_filter_ndjson(JsonFilter* filter,const char* text,size_t len,JsonFilterFunc on_match,void* user);
+
+// Stores: a document published as immutable versions that readers on any thread
+// use without locks while one writer prepares and publishes the next version.
+// A version is read only: query it with json_get/json_get_field/json_object_key/
+// json_object_value and never free it, the store does.
+
+#define JSON_STORE_MAX_READERS 64
+#define JSON_STORE_MAX_CHAIN 16     //a draft based on a longer chain of shared versions starts from a full copy
+#define JSON_STORE_IDLE UINT64_MAX
+
+typedef struct JsonVersion JsonVersion;
+
+struct JsonVersion{
+    JsonObject* root;
+    uint64_t number;            //1 for the first published version, then +1 per publish
+    JsonVersion* base;          //version whose nodes this one shares, NULL after a full copy
+    size_t chain;               //versions back to the last full copy
+    size_t refs;                //one while a draft or published, plus one per version based on it
+    uint64_t retired;           //epoch in which it was replaced
+    Arena arena;                //every node this version created
+    BUF(JsonObject** objects);  //objects created here, their fields and index may be on the heap
+    BUF(JsonValue** arrays);    //arrays created here, likewise
+    Map copied;                 //while a draft: nodes it created and may still change in place
+};
+
+typedef struct JsonStoreReader{
+    uint64_t epoch;     //store epoch when it entered, JSON_STORE_IDLE between reads
+    uint32_t claimed;
+    char pad[52];       //one cache line per reader
+}JsonStoreReader;
+
+typedef struct JsonStore{
+    JsonVersion* current;
+    uint64_t epoch;
+    JsonStoreReader readers[JSON_STORE_MAX_READERS];
+    BUF(JsonVersion** retired);     //replaced versions that readers may still hold
+}JsonStore;
+
+// Writer side, one thread at a time. The first version is a copy of doc.
+void json_store_init(JsonStore* store,JsonObject* doc);
+
+// Draft of the next version, sharing every node with the current one until edited
+JsonVersion* json_store_edit(JsonStore* store);
+
+// Sets the value at path, a key per object and a decimal index per array;
+// the last key may be new and the last index may be the array length to append.
+// value is copied. False when path is missing or crosses a scalar or packed array.
+bool json_version_set(JsonVersion* draft,const char** path,size_t depth,JsonValue* value);
+
+bool json_version_remove(JsonVersion* draft,const char** path,size_t depth);
+
+void json_version_discard(JsonVersion* draft);
+
+// Makes draft the current version and frees replaced versions no reader holds
+void json_store_publish(JsonStore* store,JsonVersion* draft);
+
+// Returns how many replaced versions were freed
+size_t json_store_reclaim(JsonStore* store);
+
+// Only once no reader is inside the store
+void json_store_free(JsonStore* store);
+
+// Reader side, any thread: claim a reader once per thread, NULL when all are taken
+JsonStoreReader* json_store_reader(JsonStore* store);
+
+void json_store_reader_release(JsonStoreReader* reader);
+
+// The version stays valid until json_store_leave; enter and leave do not nest
+JsonVersion* json_store_enter(JsonStore* store,JsonStoreReader* reader);
+
+void json_store_leave(JsonStoreReader* reader);
+
+#endif //JSON_PARSER_JSON_H
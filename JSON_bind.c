@@ -0,0 +1,228 @@
+// Bindings: decode JSON text straight into native structs, driving the lexer
+// directly, and encode structs straight into an output buffer. Known keys are
+// found by hash, unknown values are skipped, and no JsonValue/JsonField/JsonObject
+// is ever allocated.
+
+Arena json_binding_arena;  //generated quoted keys, never reset: bindings keep pointing at them
+
+void json_binding_init(JsonBinding* binding){
+    char* quoted = NULL;
+    for (JsonBindField* field = binding->fields; field != binding->fields + binding->fields_count; field++){
+        field->key_len = strlen(field->key);
+        field->hash = str_hash(field->key,field->key_len);
+        if (!field->quoted_key){
+            JsonString key = json_quote_key(&json_binding_arena,&quoted,(JsonString){(char*)field->key,field->key_len});
+            field->quoted_key = key.str;
+            field->quoted_key_len = key.len;
+        }else{
+            field->quoted_key_len = strlen(field->quoted_key);
+        }
+        if (field->binding && !field->binding->initialized){
+            json_binding_init(field->binding);
+        }
+    }
+    buf_free(quoted);
+    binding->initialized = true;
+}
+
+static JsonBindField* json_binding_find(JsonBinding* binding,const char* key,size_t len){
+    uint64_t hash = str_hash(key,len);
+    for (JsonBindField* field = binding->fields; field != binding->fields + binding->fields_count; field++){
+        if (field->hash == hash && field->key_len == len && !memcmp(field->key,key,len)){
+            return field;
+        }
+    }
+    return NULL;
+}
+
+static void json_skip_value(){
+    int depth = 0;
+    do {
+        if (is_token('{') || is_token('[')){
+            depth++;
+        }else if (is_token('}') || is_token(']')){
+            depth--;
+        }else if (is_token(TOKEN_EOF)){
+            syntax_error(token.start,JSON_ERROR_UNEXPECTED_EOF,"Unexpected end of file within value");
+        }
+        next_token();
+    } while (depth > 0);
+}
+
+static void json_decode_object(char* dst,JsonBinding* binding);
+
+static void json_decode_field(char* member,JsonBindField* field){
+    if (is_token(TOKEN_NULL)){
+        next_token();
+        return;
+    }
+    switch (field->type) {
+        case JSON_number_int:
+            if (!is_token(TOKEN_INT)){
+                syntax_error(token.start,JSON_ERROR_TYPE,"Type mismatch for field '%s'",field->key);
+            }
+            if (token.int_val < INT_MIN || token.int_val > INT_MAX){
+                syntax_error(token.start,JSON_ERROR_TYPE,"Value out of int range for field '%s'",field->key);
+            }
+            *(int*)member = (int)token.int_val;
+            break;
+        case JSON_number_float:
+            if (is_token(TOKEN_INT)){
+                *(double*)member = token.int_val;
+            }else if (is_token(TOKEN_FLOAT)){
+                *(double*)member = token.float_val;
+            }else{
+                syntax_error(token.start,JSON_ERROR_TYPE,"Type mismatch for field '%s'",field->key);
+            }
+            break;
+        case JSON_bool:
+            if (!is_token(TOKEN_TRUE) && !is_token(TOKEN_FALSE)){
+                syntax_error(token.start,JSON_ERROR_TYPE,"Type mismatch for field '%s'",field->key);
+            }
+            *(bool*)member = is_token(TOKEN_TRUE);
+            break;
+        case JSON_string: {
+            if (!is_token(TOKEN_STR)){
+                syntax_error(token.start,JSON_ERROR_TYPE,"Type mismatch for field '%s'",field->key);
+            }
+            size_t len = buf_len(token.str_val) - 1;
+            if (field->set_str){
+                field->set_str(member,token.str_val,len);
+            }else{
+                *(JsonString*)member = json_string_copy(token.str_val,len);
+            }
+            break;
+        }
+        case JSON_object:
+            if (!is_token('{')){
+                syntax_error(token.start,JSON_ERROR_TYPE,"Type mismatch for field '%s'",field->key);
+            }
+            json_decode_object(member,field->binding);
+            return;
+        default:
+            json_skip_value();
+            return;
+    }
+    next_token();
+}
+
+static void json_decode_object(char* dst,JsonBinding* binding){
+    expect_token('{');
+    if (match_token('}')){
+        return;
+    }
+    for (;;){
+        if (!is_token(TOKEN_STR)){
+            syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected string key, got %s",token_desc(token.kind));
+        }
+        JsonBindField* field = json_binding_find(binding,token.str_val,buf_len(token.str_val) - 1);
+        next_token();
+        expect_token(':');
+        if (field){
+            json_decode_field(dst + field->offset,field);
+        }else{
+            json_skip_value();
+        }
+        if (!match_token(',')){
+            expect_token('}');
+            return;
+        }
+    }
+}
+
+bool json_decode(const char* str,size_t len,void* dst,JsonBinding* binding,JsonError* error){
+    JsonError local_error;
+    error = error ? error : &local_error;
+    *error = (JsonError){JSON_OK};
+    assert(str);
+    if (!binding->initialized){
+        json_binding_init(binding);
+    }
+    lex_error = error;
+    if (setjmp(lex_error_jump)){
+        lex_error = NULL;
+        return false;
+    }
+    lex_validate = false;
+    lex_raw_numbers = false;
+    init_stream_n(str,len);
+    if (!is_token('{')){
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected '{' at top level, got %s",token_desc(token.kind));
+    }
+    json_decode_object(dst,binding);
+    json_parse_end(str,len);
+    lex_error = NULL;
+    return true;
+}
+
+static char* json_encode_object(char* buffer,const char* src,JsonBinding* binding,bool* finite){
+    buf_push(buffer,'{');
+    for (JsonBindField* field = binding->fields; field != binding->fields + binding->fields_count; field++){
+        const char* member = src + field->offset;
+        if (field != binding->fields){
+            buf_push(buffer,',');
+        }
+        buf_write(buffer,field->quoted_key,field->quoted_key_len);
+        switch (field->type) {
+            case JSON_number_int:
+                buf_printf(buffer,"%d",*(const int*)member);
+                break;
+            case JSON_number_float:
+                *finite = *finite && isfinite(*(const double*)member);
+                buffer = json_write_float(buffer,*(const double*)member);
+                break;
+            case JSON_bool:
+                if (*(const bool*)member){
+                    buf_write(buffer,"true",4);
+                }else{
+                    buf_write(buffer,"false",5);
+                }
+                break;
+            case JSON_string: {
+                JsonString str = field->get_str ? field->get_str(member) : *(const JsonString*)member;
+                if (str.str){
+                    buffer = json_write_string(buffer,str.str,str.len);
+                }else{
+                    buf_write(buffer,"null",4);
+                }
+                break;
+            }
+            case JSON_object:
+                buffer = json_encode_object(buffer,member,field->binding,finite);
+                break;
+            default:
+                buf_write(buffer,"null",4);
+                break;
+        }
+    }
+    buf_push(buffer,'}');
+    return buffer;
+}
+
+BUF(char*) json_encode(BUF(char*) buffer,const void* src,JsonBinding* binding){
+    if (!binding->initialized){
+        json_binding_init(binding);
+    }
+    bool finite = true;
+    buffer = json_encode_object(buffer,src,binding,&finite);
+    if (!finite){
+        buf_free(buffer);
+        return NULL;
+    }
+    buf_push(buffer,0);
+    buf__hdr(buffer)->len--;
+    return buffer;
+}
+
+size_t json_buffer_len(const char* buffer){
+    return buf_len(buffer);
+}
+
+void json_buffer_clear(char* buffer){
+    buf_clear(buffer);
+}
+
+void json_buffer_free(char* buffer){
+    buf_free(buffer);
+}
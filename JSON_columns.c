@@ -0,0 +1,409 @@
+// Columns: extract an array of records into struct-of-arrays buffers, one
+// contiguous buffer per key plus a validity bitmap, either from a parsed array
+// or straight from the token stream. Consumers aggregate over the buffers
+// without touching keys again.
+
+#define json_columns_resize(b,n) (buf_fit((b),(n)), (b) ? buf__hdr(b)->len = (n) : 0)
+
+void json_columns_init(JsonColumns* cols,const JsonColumnSpec* specs,size_t count){
+    memset(cols,0,sizeof(*cols));
+    cols->columns = xcalloc(count ? count : 1,sizeof(JsonColumn));
+    cols->columns_count = count;
+    for (size_t i = 0; i < count; i++){
+        JsonColumn* col = cols->columns + i;
+        assert(specs[i].type == JSON_number_int || specs[i].type == JSON_number_float ||
+               specs[i].type == JSON_bool || specs[i].type == JSON_string);
+        col->key = specs[i].key;
+        col->type = specs[i].type;
+        col->key_len = strlen(col->key);
+        col->hash = str_hash(col->key,col->key_len);
+        if (col->type == JSON_string){
+            buf_push(col->offsets,0);
+        }
+    }
+}
+
+static void json_columns_truncate(JsonColumns* cols,size_t rows){
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        switch (col->type) {
+            case JSON_number_int:
+                json_columns_resize(col->ints,rows);
+                break;
+            case JSON_number_float:
+                json_columns_resize(col->floats,rows);
+                break;
+            case JSON_bool:
+                json_columns_resize(col->bools,rows);
+                break;
+            case JSON_string:
+                json_columns_resize(col->offsets,rows + 1);
+                json_columns_resize(col->data,col->offsets[rows]);
+                break;
+            default:
+                break;
+        }
+        json_columns_resize(col->validity,(rows + 7)/8);
+        if (rows % 8){
+            col->validity[rows/8] &= (uint8_t)((1u << rows % 8) - 1);
+        }
+    }
+    cols->rows = rows;
+}
+
+void json_columns_clear(JsonColumns* cols){
+    json_columns_truncate(cols,0);
+}
+
+void json_columns_free(JsonColumns* cols){
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        switch (col->type) {
+            case JSON_number_int:
+                buf_free(col->ints);
+                break;
+            case JSON_number_float:
+                buf_free(col->floats);
+                break;
+            case JSON_bool:
+                buf_free(col->bools);
+                break;
+            case JSON_string:
+                buf_free(col->offsets);
+                break;
+            default:
+                break;
+        }
+        buf_free(col->data);
+        buf_free(col->validity);
+    }
+    free(cols->columns);
+    buf_free(cols->key_hints);
+    memset(cols,0,sizeof(*cols));
+}
+
+bool json_column_valid(const JsonColumn* col,size_t row){
+    return col->validity[row/8] >> row % 8 & 1;
+}
+
+size_t json_column_null_count(const JsonColumn* col,size_t rows){
+    size_t valid = 0;
+    for (size_t i = 0; i < rows/8; i++){
+        for (uint8_t bits = col->validity[i]; bits; bits &= bits - 1){
+            valid++;
+        }
+    }
+    for (size_t row = rows & ~(size_t)7; row < rows; row++){
+        valid += json_column_valid(col,row);
+    }
+    return rows - valid;
+}
+
+JsonString json_column_string(const JsonColumn* col,size_t row){
+    assert(col->type == JSON_string);
+    return (JsonString){col->data + col->offsets[row],col->offsets[row + 1] - col->offsets[row]};
+}
+
+typedef struct JsonColumnHint{
+    const JsonShape* shape;     //shape of the previous record, if it had one
+    size_t slot;                //where the key was in the previous record
+}JsonColumnHint;
+
+//records usually share one shape or key order, so the slot that matched the
+//previous record is tried before falling back to the hashed lookup
+static const JsonValue* json_columns_lookup(const JsonValue* record,const JsonColumn* col,JsonColumnHint* hint){
+    if (!record || record->type != JSON_object){
+        return NULL;
+    }
+    JsonObject* obj = record->object;
+    if (obj->shape){
+        //shaped objects are only read, so concurrent fills stay safe
+        if (obj->shape != hint->shape){
+            hint->shape = obj->shape;
+            hint->slot = json_shape_slot(obj->shape,col->key,col->key_len);
+        }
+        return hint->slot == obj->shape->count ? NULL : obj->values[hint->slot];
+    }
+    //with a duplicated key the hinted field may not be the latest one
+    if (hint->slot < obj->fields_count && obj->fields_map->len == obj->fields_count){
+        JsonString key = obj->fields[hint->slot]->key;
+        if (key.len == col->key_len && !memcmp(key.str,col->key,col->key_len)){
+            return obj->fields[hint->slot]->value;
+        }
+    }
+    JsonField* field = json_get_field(obj,col->key);
+    if (!field){
+        return NULL;
+    }
+    for (size_t i = 0; i < obj->fields_count; i++){
+        if (obj->fields[i] == field){
+            hint->shape = NULL;
+            hint->slot = i;
+            break;
+        }
+    }
+    return field->value;
+}
+
+//the one rule for int cells: an integral value in int64_t range
+static bool json_column_int_from_double(double number,int64_t* result){
+    if (number != floor(number) || number < -9223372036854775808.0 || number >= 9223372036854775808.0){
+        return false;
+    }
+    *result = (int64_t)number;
+    return true;
+}
+
+static bool json_column_store(JsonColumn* col,size_t row,const JsonValue* value){
+    switch (col->type) {
+        case JSON_number_int:
+            if (value->type == JSON_number_int){
+                col->ints[row] = value->int_number;
+                return true;
+            }
+            if (value->type == JSON_number_raw && json_number_text_is_integer(json_get_string(value))){
+                //beyond int64_t the lexer would have made it a double
+                errno = 0;
+                int64_t number = strtoll(json_get_string(value).str,NULL,10);
+                if (errno != ERANGE){
+                    col->ints[row] = number;
+                    return true;
+                }
+            }
+            if (value->type == JSON_number_float || value->type == JSON_number_raw){
+                return json_column_int_from_double(json_number_as_double(value),col->ints + row);
+            }
+            return false;
+        case JSON_number_float:
+            if (value->type == JSON_number_int || value->type == JSON_number_float || value->type == JSON_number_raw){
+                col->floats[row] = json_number_as_double(value);
+                return true;
+            }
+            return false;
+        case JSON_bool:
+            if (value->type == JSON_bool){
+                col->bools[row] = value->boolean;
+                return true;
+            }
+            return false;
+        case JSON_string:
+            if (value->type == JSON_string){
+                JsonString str = json_get_string(value);
+                memcpy(col->data + col->offsets[row],str.str,str.len);
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+void json_columns_prepare(JsonColumns* cols,const JsonValue* records){
+    assert(records->type == JSON_array);
+    size_t rows = records->len;
+    json_columns_clear(cols);
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        switch (col->type) {
+            case JSON_number_int:
+                json_columns_resize(col->ints,rows);
+                memset(col->ints,0,rows*sizeof(*col->ints));
+                break;
+            case JSON_number_float:
+                json_columns_resize(col->floats,rows);
+                memset(col->floats,0,rows*sizeof(*col->floats));
+                break;
+            case JSON_bool:
+                json_columns_resize(col->bools,rows);
+                memset(col->bools,0,rows*sizeof(*col->bools));
+                break;
+            case JSON_string: {
+                //string offsets are laid out up front so rows can be copied in any order
+                json_columns_resize(col->offsets,rows + 1);
+                JsonColumnHint hint = {0};
+                for (size_t row = 0; row < rows; row++){
+                    const JsonValue* value = json_columns_lookup(records->values[row],col,&hint);
+                    size_t len = value && value->type == JSON_string ? json_get_string(value).len : 0;
+                    col->offsets[row + 1] = col->offsets[row] + len;
+                }
+                json_columns_resize(col->data,col->offsets[rows]);
+                break;
+            }
+            default:
+                break;
+        }
+        json_columns_resize(col->validity,(rows + 7)/8);
+        if (rows){
+            memset(col->validity,0,(rows + 7)/8);
+        }
+    }
+    cols->rows = rows;
+}
+
+// Fills rows [begin,end) of buffers sized by json_columns_prepare. Disjoint
+// ranges touch disjoint memory as long as each begin is a multiple of 8 (the
+// validity bitmap is written per byte), so batches can run on separate threads.
+void json_columns_fill(JsonColumns* cols,const JsonValue* records,size_t begin,size_t end){
+    assert(records->type == JSON_array && records->len == cols->rows);
+    assert(begin <= end && end <= cols->rows);
+    assert(begin % 8 == 0);
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        JsonColumnHint hint = {0};
+        for (size_t row = begin; row < end; row++){
+            const JsonValue* value = json_columns_lookup(records->values[row],col,&hint);
+            if (value && json_column_store(col,row,value)){
+                col->validity[row/8] |= (uint8_t)(1u << row % 8);
+            }
+        }
+    }
+}
+
+static JsonColumn* json_columns_match(JsonColumns* cols,size_t position,const char* key,size_t len){
+    if (position < buf_len(cols->key_hints) && cols->key_hints[position]){
+        JsonColumn* col = cols->columns + cols->key_hints[position] - 1;
+        if (col->key_len == len && !memcmp(col->key,key,len)){
+            return col;
+        }
+    }
+    uint64_t hash = str_hash(key,len);
+    JsonColumn* found = NULL;
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        if (col->hash == hash && col->key_len == len && !memcmp(col->key,key,len)){
+            found = col;
+            break;
+        }
+    }
+    while (buf_len(cols->key_hints) <= position){
+        buf_push(cols->key_hints,0);
+    }
+    cols->key_hints[position] = found ? (uint32_t)(found - cols->columns + 1) : 0;
+    return found;
+}
+
+// A repeated key replaces what the earlier one stored, so the last value wins
+static void json_columns_decode_value(JsonColumn* col,size_t row){
+    uint8_t bit = (uint8_t)(1u << row % 8);
+    bool valid = false;
+    col->validity[row/8] &= (uint8_t)~bit;
+    switch (col->type) {
+        case JSON_number_int:
+            col->ints[row] = 0;
+            if ((valid = is_token(TOKEN_INT))){
+                col->ints[row] = token.int_val;
+            }else if (is_token(TOKEN_FLOAT)){
+                valid = json_column_int_from_double(token.float_val,col->ints + row);
+            }
+            break;
+        case JSON_number_float:
+            col->floats[row] = 0;
+            if ((valid = is_token(TOKEN_INT))){
+                col->floats[row] = (double)token.int_val;
+            }else if ((valid = is_token(TOKEN_FLOAT))){
+                col->floats[row] = token.float_val;
+            }
+            break;
+        case JSON_bool:
+            col->bools[row] = 0;
+            if ((valid = is_token(TOKEN_TRUE) || is_token(TOKEN_FALSE))){
+                col->bools[row] = is_token(TOKEN_TRUE);
+            }
+            break;
+        case JSON_string:
+            json_columns_resize(col->data,col->offsets[row]);
+            if ((valid = is_token(TOKEN_STR))){
+                buf_write(col->data,token.str_val,buf_len(token.str_val) - 1);
+            }
+            break;
+        default:
+            break;
+    }
+    if (valid){
+        col->validity[row/8] |= bit;
+        next_token();
+    }else{
+        json_skip_value();
+    }
+}
+
+static void json_columns_decode_record(JsonColumns* cols){
+    if (!is_token('{')){
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected record object, got %s",token_desc(token.kind));
+    }
+    size_t row = cols->rows;
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        switch (col->type) {
+            case JSON_number_int:
+                buf_push(col->ints,0);
+                break;
+            case JSON_number_float:
+                buf_push(col->floats,0);
+                break;
+            case JSON_bool:
+                buf_push(col->bools,0);
+                break;
+            default:
+                break;
+        }
+        if (row % 8 == 0){
+            buf_push(col->validity,0);
+        }
+    }
+    next_token();
+    if (!match_token('}')){
+        for (size_t position = 0;; position++){
+            if (!is_token(TOKEN_STR)){
+                syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected string key, got %s",token_desc(token.kind));
+            }
+            JsonColumn* col = json_columns_match(cols,position,token.str_val,buf_len(token.str_val) - 1);
+            next_token();
+            expect_token(':');
+            if (col){
+                json_columns_decode_value(col,row);
+            }else{
+                json_skip_value();
+            }
+            if (!match_token(',')){
+                expect_token('}');
+                break;
+            }
+        }
+    }
+    for (JsonColumn* col = cols->columns; col != cols->columns + cols->columns_count; col++){
+        if (col->type == JSON_string){
+            buf_push(col->offsets,buf_len(col->data));
+        }
+    }
+    cols->rows++;
+}
+
+// Appends the records of a top-level array to the columns without building
+// a tree, so one set of columns can collect several batches. On error the
+// columns are left as they were before the call.
+bool json_columns_decode(JsonColumns* cols,const char* str,size_t len,JsonError* error){
+    JsonError local_error;
+    error = error ? error : &local_error;
+    *error = (JsonError){JSON_OK};
+    assert(str);
+    size_t rows = cols->rows;
+    lex_error = error;
+    if (setjmp(lex_error_jump)){
+        lex_error = NULL;
+        json_columns_truncate(cols,rows);
+        return false;
+    }
+    lex_validate = false;
+    lex_raw_numbers = false;
+    init_stream_n(str,len);
+    if (!is_token('[')){
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected '[' at top level, got %s",token_desc(token.kind));
+    }
+    next_token();
+    if (!match_token(']')){
+        do {
+            json_columns_decode_record(cols);
+        } while (match_token(','));
+        expect_token(']');
+    }
+    json_parse_end(str,len);
+    lex_error = NULL;
+    return true;
+}
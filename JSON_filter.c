@@ -0,0 +1,293 @@
+// Filters: a conjunction of `key op literal` terms, e.g.
+//   level == "error" && latency_ms > 500
+// compiled once and checked against each NDJSON record as its top-level keys
+// are lexed. A record is decided as soon as one term fails or the last one
+// holds; the rest of the line is then skipped with memchr instead of being
+// lexed, so nothing past the deciding value is read or validated.
+
+static JsonString json_filter_copy(const char* str,size_t len){
+    char* copy = xmalloc(len + 1);
+    memcpy(copy,str,len);
+    copy[len] = 0;
+    return (JsonString){copy,len};
+}
+
+static JsonFilterOp json_filter_scan_op(){
+    int first = token.kind;
+    const char* start = token.start;
+    if (first != '=' && first != '!' && first != '<' && first != '>'){
+        syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected comparison operator, got %s",token_desc(token.kind));
+    }
+    next_token();
+    bool eq = is_token('=') && token.start == start + 1;
+    if (eq){
+        next_token();
+    }else if (first == '=' || first == '!'){
+        syntax_error(start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected '%c='",first);
+    }
+    switch (first) {
+        case '=':
+            return JSON_FILTER_EQ;
+        case '!':
+            return JSON_FILTER_NE;
+        case '<':
+            return eq ? JSON_FILTER_LE : JSON_FILTER_LT;
+        default:
+            return eq ? JSON_FILTER_GE : JSON_FILTER_GT;
+    }
+}
+
+static void json_filter_scan_term(JsonFilter* filter){
+    JsonFilterTerm term = {0};
+    if (is_token(TOKEN_NAME)){
+        term.key = json_filter_copy(token.start,token.end - token.start);
+    }else if (is_token(TOKEN_STR)){
+        term.key = json_filter_copy(token.str_val,buf_len(token.str_val) - 1);
+    }else{
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected key, got %s",token_desc(token.kind));
+    }
+    //owned by the filter from here on, so an error below still frees the key
+    buf_push(filter->terms,term);
+    JsonFilterTerm* last = buf_end(filter->terms) - 1;
+    next_token();
+    last->op = json_filter_scan_op();
+    switch (token.kind) {
+        case TOKEN_INT:
+            last->type = JSON_number_float;
+            last->number = (double)token.int_val;
+            break;
+        case TOKEN_FLOAT:
+            last->type = JSON_number_float;
+            last->number = token.float_val;
+            break;
+        case TOKEN_STR:
+            last->type = JSON_string;
+            last->string = json_filter_copy(token.str_val,buf_len(token.str_val) - 1);
+            break;
+        case TOKEN_TRUE:
+        case TOKEN_FALSE:
+            last->type = JSON_bool;
+            last->boolean = is_token(TOKEN_TRUE);
+            break;
+        case TOKEN_NULL:
+            last->type = JSON_null;
+            break;
+        default:
+            syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                         "Expected literal, got %s",token_desc(token.kind));
+    }
+    if ((last->type == JSON_bool || last->type == JSON_null) && last->op != JSON_FILTER_EQ && last->op != JSON_FILTER_NE){
+        syntax_error(token.start,JSON_ERROR_TYPE,"Only == and != apply to %s",token_desc(token.kind));
+    }
+    next_token();
+}
+
+bool json_filter_compile(JsonFilter* filter,const char* expr,JsonError* error){
+    JsonError local_error;
+    error = error ? error : &local_error;
+    *error = (JsonError){JSON_OK};
+    memset(filter,0,sizeof(*filter));
+    lex_error = error;
+    if (setjmp(lex_error_jump)){
+        lex_error = NULL;
+        json_filter_free(filter);
+        return false;
+    }
+    lex_validate = false;
+    lex_raw_numbers = false;
+    init_stream(expr);
+    for (;;){
+        if (buf_len(filter->terms) == JSON_FILTER_MAX_TERMS){
+            syntax_error(token.start,JSON_ERROR_DEPTH,"More than %d terms",JSON_FILTER_MAX_TERMS);
+        }
+        json_filter_scan_term(filter);
+        if (is_token(TOKEN_EOF)){
+            break;
+        }
+        const char* start = token.start;
+        if (!is_token('&')){
+            syntax_error(token.start,JSON_ERROR_TRAILING,"Expected '&&', got %s",token_desc(token.kind));
+        }
+        next_token();
+        if (!is_token('&') || token.start != start + 1){
+            syntax_error(start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected '&&'");
+        }
+        next_token();
+    }
+    lex_error = NULL;
+    return true;
+}
+
+void json_filter_free(JsonFilter* filter){
+    for (JsonFilterTerm* term = filter->terms; term != buf_end(filter->terms); term++){
+        free(term->key.str);
+        if (term->type == JSON_string){
+            free(term->string.str);
+        }
+    }
+    buf_free(filter->terms);
+    memset(filter,0,sizeof(*filter));
+}
+
+// Compares the current token against a term. Values of another type (or
+// containers) are only ever "not equal".
+static bool json_filter_test(const JsonFilterTerm* term){
+    int cmp = 0;
+    bool comparable = false;
+    switch (term->type) {
+        case JSON_number_float:
+            if (is_token(TOKEN_INT) || is_token(TOKEN_FLOAT)){
+                double number = is_token(TOKEN_INT) ? (double)token.int_val : token.float_val;
+                cmp = (number > term->number) - (number < term->number);
+                comparable = true;
+            }
+            break;
+        case JSON_string:
+            if (is_token(TOKEN_STR)){
+                size_t len = buf_len(token.str_val) - 1;
+                cmp = memcmp(token.str_val,term->string.str,MIN(len,term->string.len));
+                cmp = cmp ? cmp : (len > term->string.len) - (len < term->string.len);
+                comparable = true;
+            }
+            break;
+        case JSON_bool:
+            if (is_token(TOKEN_TRUE) || is_token(TOKEN_FALSE)){
+                cmp = is_token(TOKEN_TRUE) != term->boolean;
+                comparable = true;
+            }
+            break;
+        case JSON_null:
+            comparable = is_token(TOKEN_NULL);
+            break;
+        default:
+            break;
+    }
+    if (!comparable){
+        return term->op == JSON_FILTER_NE;
+    }
+    switch (term->op) {
+        case JSON_FILTER_EQ:
+            return cmp == 0;
+        case JSON_FILTER_NE:
+            return cmp != 0;
+        case JSON_FILTER_LT:
+            return cmp < 0;
+        case JSON_FILTER_LE:
+            return cmp <= 0;
+        case JSON_FILTER_GT:
+            return cmp > 0;
+        default:
+            return cmp >= 0;
+    }
+}
+
+static uint64_t json_filter_terms_for(const JsonFilter* filter,const char* key,size_t len){
+    uint64_t mask = 0;
+    for (size_t i = 0; i < buf_len(filter->terms); i++){
+        if (filter->terms[i].key.len == len && !memcmp(filter->terms[i].key.str,key,len)){
+            mask |= (uint64_t)1 << i;
+        }
+    }
+    return mask;
+}
+
+// Reads the record in the current token up to the value that decides it.
+// Keys that no pending term names have their values skipped in validation
+// mode, so their strings are never copied.
+static bool json_filter_record(const JsonFilter* filter){
+    if (!is_token('{')){
+        syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected record object, got %s",token_desc(token.kind));
+    }
+    size_t count = buf_len(filter->terms);
+    uint64_t pending = count == 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+    if (!pending){
+        return true;
+    }
+    next_token();
+    if (!is_token('}')){
+        for (;;){
+            if (!is_token(TOKEN_STR)){
+                syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected string key, got %s",token_desc(token.kind));
+            }
+            uint64_t mask = pending & json_filter_terms_for(filter,token.str_val,buf_len(token.str_val) - 1);
+            next_token();
+            lex_validate = !mask;
+            expect_token(':');
+            if (mask){
+                for (size_t i = 0; i < count; i++){
+                    if (mask >> i & 1 && !json_filter_test(filter->terms + i)){
+                        return false;
+                    }
+                }
+                pending &= ~mask;
+                if (!pending){
+                    return true;
+                }
+            }
+            json_skip_value();
+            lex_validate = false;
+            if (!match_token(',')){
+                break;
+            }
+        }
+        if (!is_token('}')){
+            syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Expected ',' or '}', got %s",token_desc(token.kind));
+        }
+    }
+    return false;
+}
+
+// Returns 1 for a match, 0 for a miss, -1 for a blank line and -2 for a
+// malformed record. The lexer stops at end, so a truncated record ends at its
+// own line instead of running into the next ones.
+static int json_filter_line(JsonFilter* filter,const char* start,const char* end){
+    JsonError error;
+    lex_error = &error;
+    if (setjmp(lex_error_jump)){
+        lex_error = NULL;
+        lex_validate = false;
+        return -2;
+    }
+    lex_validate = false;
+    lex_raw_numbers = false;
+    init_stream_n(start,end - start);
+    if (token.start >= end){
+        lex_error = NULL;
+        return -1;
+    }
+    bool match = json_filter_record(filter);
+    lex_error = NULL;
+    return match;
+}
+
+bool json_filter_match(JsonFilter* filter,const char* record,size_t len){
+    assert(record);
+    int result = json_filter_line(filter,record,record + len);
+    filter->records += result != -1;
+    filter->matches += result == 1;
+    filter->malformed += result == -2;
+    return result == 1;
+}
+
+size_t json_filter_ndjson(JsonFilter* filter,const char* text,size_t len,JsonFilterFunc on_match,void* user){
+    assert(text);
+    size_t matches = 0;
+    const char* text_end = text + len;
+    for (const char* line = text; line < text_end;){
+        const char* end = memchr(line,'\n',text_end - line);
+        end = end ? end : text_end;
+        int result = json_filter_line(filter,line,end);
+        filter->records += result != -1;
+        filter->malformed += result == -2;
+        if (result == 1){
+            matches++;
+            filter->matches++;
+            if (on_match && !on_match(line,end - line,user)){
+                break;
+            }
+        }
+        line = end + 1;
+    }
+    return matches;
+}
@@ -1,92 +1,395 @@
+// Iterative parser: every open object or array is a frame on an explicit
+// stack, so nesting depth costs heap, not C stack, and is capped by
+// json_max_depth.
 
-static JsonObject* json_parse_object();
+size_t json_max_depth = JSON_MAX_DEPTH_DEFAULT;
 
-static JsonValue* json_parse_value(){
+void json_set_max_depth(size_t depth){
+    json_max_depth = depth ? depth : JSON_MAX_DEPTH_DEFAULT;
+}
+
+bool json_lazy_numbers;
+
+void json_set_lazy_numbers(bool lazy){
+    json_lazy_numbers = lazy;
+}
+
+bool json_packed_arrays;
+
+void json_set_packed_arrays(bool packed){
+    json_packed_arrays = packed;
+}
+
+bool json_shared_shapes;
+
+void json_set_shared_shapes(bool shared){
+    json_shared_shapes = shared;
+}
+
+typedef struct JsonParseFrame{
+    JsonValue* value;       //the object or array being filled
+    const char* key;        //key of the next field, objects only
+    JsonShape* shape;       //keys so far of an object whose values are in json_parse_values
+    size_t first;           //its first value in json_parse_values
+    bool packing;           //array elements so far are numbers held in json_parse_numbers
+    bool packing_ints;      //...and all of them are integers
+}JsonParseFrame;
+
+typedef union JsonPackedNumber{
+    double f;
+    int64_t i;
+}JsonPackedNumber;
+
+// Numbers of the packing array. Only the top frame can be packing: opening a
+// nested container or reading a non-number unpacks it first.
+BUF(JsonPackedNumber* json_parse_numbers);
+
+BUF(JsonParseFrame* json_parse_stack);  //reused by every json_parse
+BUF(JsonValue** json_parse_values);     //values of open shaped objects, innermost last
+JsonValue* json_parse_root;             //set once the top-level object is closed
+
+static void json_unexpected_token(){
+    if (is_token(TOKEN_NAME)){
+        syntax_error(token.start,JSON_ERROR_UNEXPECTED_TOKEN,"Unexpected name '%.*s'",
+                     (int)(token.end - token.start),token.start);
+    }
+    syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                 "Unexpected %s",token_desc(token.kind));
+}
+
+static void json_check_key(){
+    if (!is_token(TOKEN_STR)){
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected string key, got %s",token_desc(token.kind));
+    }
+}
+
+static const char* json_parse_key(){
+    json_check_key();
+    const char* key = json_string_copy(token.str_val,buf_len(token.str_val) - 1).str;
+    next_token();
+    expect_token(':');
+    return key;
+}
+
+// Next key of an object frame: shaped frames step to the child shape and
+// fall back to fields when the shape has too many children already
+static void json_parse_frame_key(JsonParseFrame* frame){
+    if (frame->shape){
+        json_check_key();
+        JsonShape* shape = json_shape_child(frame->shape,token.str_val,buf_len(token.str_val) - 1);
+        if (shape){
+            frame->shape = shape;
+            next_token();
+            expect_token(':');
+            return;
+        }
+        json_object_unshare_values(json_arena,frame->value->object,frame->shape,json_parse_values + frame->first);
+        buf__hdr(json_parse_values)->len = frame->first;
+        frame->shape = NULL;
+    }
+    frame->key = json_parse_key();
+}
+
+static void json_close_shaped(JsonParseFrame* frame){
+    JsonObject* obj = frame->value->object;
+    size_t count = frame->shape->count;
+    assert(buf_len(json_parse_values) == frame->first + count);
+    obj->shape = json_shape_finish(frame->shape);
+    obj->values_arena = json_arena;
+    obj->fields_count = count;
+    if (count){
+        obj->values = arena_alloc(json_arena,count*sizeof(JsonValue*));
+        memcpy(obj->values,json_parse_values + frame->first,count*sizeof(JsonValue*));
+    }
+    buf__hdr(json_parse_values)->len = frame->first;
+}
+
+static void json_validate_key(){
+    json_check_key();
+    next_token();
+    expect_token(':');
+}
+
+// JSON_number_int holds an int, wider integers are stored as floats
+static JsonValue* json_value_integer(int64_t val){
+    if (val >= INT_MIN && val <= INT_MAX){
+        return json_value_number_int((int)val);
+    }
+    return json_value_number_float((double)val);
+}
+
+static void json_pack_number(JsonParseFrame* frame){
+    JsonPackedNumber number;
+    if (is_token(TOKEN_INT) && frame->packing_ints){
+        number.i = token.int_val;
+    }else{
+        if (frame->packing_ints){
+            for (JsonPackedNumber* it = json_parse_numbers; it != buf_end(json_parse_numbers); it++){
+                it->f = (double)it->i;
+            }
+            frame->packing_ints = false;
+        }
+        number.f = is_token(TOKEN_INT) ? (double)token.int_val : token.float_val;
+    }
+    buf_push(json_parse_numbers,number);
+    next_token();
+}
+
+static void json_unpack_numbers(JsonParseFrame* frame){
+    JsonValue* array = frame->value;
+    buf_fit(array->values,buf_len(json_parse_numbers) + 1);
+    for (JsonPackedNumber* it = json_parse_numbers; it != buf_end(json_parse_numbers); it++){
+        json_value_array_push(array,frame->packing_ints ? json_value_integer(it->i) : json_value_number_float(it->f));
+    }
+    buf_clear(json_parse_numbers);
+    frame->packing = false;
+}
+
+static void json_close_packed(JsonParseFrame* frame){
+    size_t count = buf_len(json_parse_numbers);
+    JsonValue* array = frame->value;
+    assert(count <= UINT32_MAX);
+    array->type = frame->packing_ints ? JSON_array_int : JSON_array_float;
+    array->floats = arena_alloc(json_arena,count*sizeof(JsonPackedNumber));
+    memcpy(array->floats,json_parse_numbers,count*sizeof(JsonPackedNumber));
+    array->len = (uint32_t)count;
+    buf_clear(json_parse_numbers);
+}
+
+static JsonValue* json_parse_scalar(){
     JsonValue* new_value = NULL;
     switch (token.kind) {
         case TOKEN_STR:
-            new_value = json_value_string((JsonString){token.str_val,buf_len(token.str_val)});
+            new_value = json_value_string_n(token.str_val,buf_len(token.str_val) - 1);
             break;
         case TOKEN_INT:
-            new_value = json_value_number_int(token.int_val);
-            break;
         case TOKEN_FLOAT:
-            new_value = json_value_number_float(token.float_val);
-            break;
-        case TOKEN_NAME:
-            if (is_keyword_str(token.name)){
-                if (token.name == true_keyword){
-                    new_value = json_value_boolean( 1);
-                }else if(token.name == false_keyword){
-                    new_value = json_value_boolean( 0);
-                }else if(token.name == null_keyword){
-                    new_value = json_value_null();
-                }
+            if (json_lazy_numbers){
+                new_value = json_value_text_copy(JSON_number_raw,token.start,token.end - token.start);
+            }else if (is_token(TOKEN_INT)){
+                new_value = json_value_integer(token.int_val);
             }else{
-                fatal("Unexpected name token");
+                new_value = json_value_number_float(token.float_val);
             }
             break;
-        case '[':
-            new_value = json_value_array(NULL,0);
-            next_token();
-            if(!is_token(']')){
-                for(;;){
-                    json_array_push(&new_value->array,json_parse_value());
-                    if (!is_token(',')){
-                        if (is_token(']')){
-                            break;
-                        }else{
-                            expect_token(']');
-                        }
-                    }
-                    next_token();
-                }
-            }
+        case TOKEN_TRUE:
+            new_value = json_value_boolean(1);
             break;
-        case '{':
-            next_token();
-            new_value = json_value_object(json_parse_object());
+        case TOKEN_FALSE:
+            new_value = json_value_boolean(0);
+            break;
+        case TOKEN_NULL:
+            new_value = json_value_null();
+            break;
+        default:
+            json_unexpected_token();
             break;
     }
-    assert(new_value);
     next_token();
     return new_value;
 }
 
-static JsonField* json_parse_field(){
-    const char* key = token.str_val;
-    next_token();
-    if(expect_token(':')){
-        return json_field(key,json_parse_value());
-    } else{
-        return NULL;
+static void json_parse_end(const char* str,size_t len){
+    if (!is_token(TOKEN_EOF)){
+        syntax_error(token.start,JSON_ERROR_TRAILING,"Unexpected content after top-level value");
+    }
+    if (token.start != str + len){
+        syntax_error(token.start,JSON_ERROR_TRAILING,"Unexpected NUL byte");
     }
 }
 
-static JsonObject* json_parse_object(){
-    JsonObject* object = json_object(NULL,0);
-    while (1){
-        if (is_token(TOKEN_STR)){
-            json_put_field(object,json_parse_field());
-            if (is_token('}')){
-                break;
+static void json_parse_abort(){
+    //containers are attached to their parent only once closed, so every open
+    //one is still owned by its frame
+    for (JsonParseFrame* frame = json_parse_stack; frame != buf_end(json_parse_stack); frame++){
+        json_free_value(frame->value);
+    }
+    for (JsonValue** value = json_parse_values; value != buf_end(json_parse_values); value++){
+        json_free_value(*value);
+    }
+    buf_clear(json_parse_stack);
+    buf_clear(json_parse_values);
+    if (json_parse_root){
+        json_free_value(json_parse_root);
+        json_parse_root = NULL;
+    }
+}
+
+JsonObject* json_parse_n(const char* str,size_t len,JsonError* error){
+    JsonError local_error;
+    error = error ? error : &local_error;
+    *error = (JsonError){JSON_OK};
+    assert(str);
+    buf_clear(json_parse_stack);
+    buf_clear(json_parse_numbers);
+    buf_clear(json_parse_values);
+    json_parse_root = NULL;
+    lex_error = error;
+    if (setjmp(lex_error_jump)){
+        lex_error = NULL;
+        json_parse_abort();
+        return NULL;
+    }
+    lex_validate = false;
+    lex_raw_numbers = json_lazy_numbers;
+    init_stream_n(str,len);
+    if (!is_token('{')){
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected '{' at top level, got %s",token_desc(token.kind));
+    }
+    bool packing = json_packed_arrays && !json_lazy_numbers;
+    JsonValue* value = NULL;
+    for (;;){
+        JsonParseFrame* open = buf_len(json_parse_stack) ? buf_end(json_parse_stack) - 1 : NULL;
+        if (open && open->packing){
+            if (is_token(TOKEN_INT) || is_token(TOKEN_FLOAT)){
+                json_pack_number(open);
+                value = NULL;
+                goto attach;
+            }
+            json_unpack_numbers(open);
+        }
+        if (is_token('{') || is_token('[')){
+            if (buf_len(json_parse_stack) >= json_max_depth){
+                syntax_error(token.start,JSON_ERROR_DEPTH,"Nesting deeper than %zu levels",json_max_depth);
+            }
+            bool is_object = is_token('{');
+            bool shaped = is_object && json_shared_shapes;
+            if (shaped){
+                value = json_value_object(arena_calloc(json_arena,1,sizeof(JsonObject)));
             }else{
-                expect_token(',');
+                value = is_object ? json_value_object(NULL) : json_value_array(NULL,0);
+            }
+            next_token();
+            if (!match_token(is_object ? '}' : ']')){
+                JsonParseFrame frame = {value,NULL,shaped ? &json_shape_root : NULL,buf_len(json_parse_values),
+                                        !is_object && packing,true};
+                if (is_object){
+                    json_parse_frame_key(&frame);
+                }
+                buf_push(json_parse_stack,frame);
+                continue;
             }
-        }else if(expect_token('}')){
-            return object;
+            if (shaped){
+                value->object->shape = &json_shape_root;
+                value->object->values_arena = json_arena;
+            }
+        }else{
+            value = json_parse_scalar();
+        }
+
+        attach:
+
+        //attach the finished value, closing every container it completes
+        while (buf_len(json_parse_stack)){
+            JsonParseFrame* top = buf_end(json_parse_stack) - 1;
+            if (top->value->type == JSON_object){
+                if (top->shape){
+                    buf_push(json_parse_values,value);
+                }else{
+                    json_put_field(top->value->object,json_field(top->key,value));
+                }
+                if (match_token(',')){
+                    json_parse_frame_key(top);
+                    break;
+                }
+                expect_token('}');
+                if (top->shape){
+                    json_close_shaped(top);
+                }
+            }else{
+                if (value){
+                    json_value_array_push(top->value,value);
+                }
+                if (match_token(',')){
+                    break;
+                }
+                expect_token(']');
+                if (top->packing){
+                    json_close_packed(top);
+                }
+            }
+            value = top->value;
+            buf__hdr(json_parse_stack)->len--;
+        }
+        if (!buf_len(json_parse_stack)){
+            break;
         }
     }
-    return object;
+    json_parse_root = value;
+    json_parse_end(str,len);
+    json_parse_root = NULL;
+    lex_error = NULL;
+    return value->object;
 }
 
 JsonObject* json_parse(char* str){
-    init_stream(str);
-    init_keywords();
-    if (match_token('{')){
-        return json_parse_object();
-    }
-    arena_free(&str_arena);
-    free(interns.entries);
-    return NULL;
+    return json_parse_n(str,strlen(str),NULL);
+}
+
+// Validation runs the same grammar with lex_validate set: strings and
+// numbers are checked but not converted, except numbers that could overflow
+// a double, nothing is copied, and the only state is one byte per open container.
+
+BUF(char* json_validate_stack);
+
+bool json_validate(const char* str,size_t len,JsonError* error){
+    JsonError local_error;
+    error = error ? error : &local_error;
+    *error = (JsonError){JSON_OK};
+    assert(str);
+    lex_error = error;
+    if (setjmp(lex_error_jump)){
+        lex_error = NULL;
+        lex_validate = false;
+        return false;
+    }
+    lex_validate = true;
+    init_stream_n(str,len);
+    buf_clear(json_validate_stack);
+    if (!is_token('{')){
+        syntax_error(token.start,is_token(TOKEN_EOF) ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected '{' at top level, got %s",token_desc(token.kind));
+    }
+    for (;;){
+        if (is_token('{') || is_token('[')){
+            if (buf_len(json_validate_stack) >= json_max_depth){
+                syntax_error(token.start,JSON_ERROR_DEPTH,"Nesting deeper than %zu levels",json_max_depth);
+            }
+            char close = is_token('{') ? '}' : ']';
+            next_token();
+            if (!match_token(close)){
+                if (close == '}'){
+                    json_validate_key();
+                }
+                buf_push(json_validate_stack,close);
+                continue;
+            }
+        }else if (is_token(TOKEN_STR) || is_token(TOKEN_INT) || is_token(TOKEN_FLOAT) ||
+                  is_token(TOKEN_TRUE) || is_token(TOKEN_FALSE) || is_token(TOKEN_NULL)){
+            next_token();
+        }else{
+            json_unexpected_token();
+        }
+
+        while (buf_len(json_validate_stack)){
+            char close = json_validate_stack[buf_len(json_validate_stack) - 1];
+            if (match_token(',')){
+                if (close == '}'){
+                    json_validate_key();
+                }
+                break;
+            }
+            expect_token(close);
+            buf__hdr(json_validate_stack)->len--;
+        }
+        if (!buf_len(json_validate_stack)){
+            break;
+        }
+    }
+    json_parse_end(str,len);
+    lex_error = NULL;
+    lex_validate = false;
+    return true;
 }
@@ -1,85 +1,407 @@
-int indent = 0;
+// Short escapes for control characters, 'u' means \u00XX
+const char json_escape_chars[0x20] = {
+        'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+        'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+};
 
-#define buf_printf_newline(buf)\
-buf_printf(buf,"\n%.*s", 2*indent, "                                                                               ")
+// Length of the leading run of str that can be copied without escaping.
+// Bytes >= 0x80 pass through untouched, the input is assumed to be UTF-8.
+static size_t json_clean_run(const char* str,size_t len){
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    for (; i + 16 <= len; i += 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(str + i));
+        //max(c,0x1F) == 0x1F only for c <= 0x1F
+        __m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk,quote),_mm_cmpeq_epi8(chunk,backslash)),
+                                    _mm_cmpeq_epi8(_mm_max_epu8(chunk,control),control));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(stop);
+        if (mask){
+            return i + map_first_bit(mask);
+        }
+    }
+#endif
+    for (; i < len; i++){
+        uint8_t c = str[i];
+        if (c == '"' || c == '\\' || c < 0x20){
+            break;
+        }
+    }
+    return i;
+}
+
+// Appends str as a quoted, escaped JSON string. Clean runs are copied in bulk,
+// embedded NULs are escaped rather than ending the string.
+char* json_write_string(BUF(char* buffer),const char* str,size_t len){
+    buf_fit(buffer,buf_len(buffer) + len + 2);
+    buf_push(buffer,'"');
+    for (;;){
+        size_t run = json_clean_run(str,len);
+        buf_write(buffer,str,run);
+        if (run == len){
+            break;
+        }
+        uint8_t c = str[run];
+        if (c == '"' || c == '\\'){
+            buf_push(buffer,'\\');
+            buf_push(buffer,c);
+        }else if (json_escape_chars[c] != 'u'){
+            buf_push(buffer,'\\');
+            buf_push(buffer,json_escape_chars[c]);
+        }else{
+            buf_printf(buffer,"\\u%04x",c);
+        }
+        str += run + 1;
+        len -= run + 1;
+    }
+    buf_push(buffer,'"');
+    return buffer;
+}
+
+// Caches the escaped "key": of every field, so printing copies keys in one go
+static void json_quote_value_keys(JsonValue* value){
+    if (value->type == JSON_object){
+        json_quote_keys(value->object);
+    }else if (value->type == JSON_array){
+        for (size_t i = 0; i < value->len; i++){
+            json_quote_value_keys(value->values[i]);
+        }
+    }
+}
+
+static JsonString json_quote_key(Arena* arena,char** quoted,JsonString key){
+    buf_clear(*quoted);
+    *quoted = json_write_string(*quoted,key.str,key.len);
+    buf_push(*quoted,':');
+    char* copy = arena_alloc(arena,buf_len(*quoted));
+    memcpy(copy,*quoted,buf_len(*quoted));
+    return (JsonString){copy,buf_len(*quoted)};
+}
+
+void json_quote_keys(JsonObject* obj){
+    assert(obj);
+    char* quoted = NULL;
+    if (obj->shape){
+        //quoted once per shape, for every object sharing it
+        JsonShape* shape = obj->shape;
+        if (!shape->quoted_keys && shape->count){
+            shape->quoted_keys = arena_alloc(&json_shape_arena,shape->count*sizeof(JsonString));
+            for (size_t i = 0; i < shape->count; i++){
+                shape->quoted_keys[i] = json_quote_key(&json_shape_arena,&quoted,shape->keys[i]);
+            }
+        }
+        for (size_t i = 0; i < obj->fields_count; i++){
+            if (obj->values[i]){
+                json_quote_value_keys(obj->values[i]);
+            }
+        }
+        buf_free(quoted);
+        return;
+    }
+    Arena* arena = obj->arena ? obj->arena : json_arena;
+    for (JsonField** it = obj->fields; it != obj->fields + obj->fields_count; it++){
+        JsonField* field = *it;
+        if (!field->quoted_key.str){
+            field->quoted_key = json_quote_key(arena,&quoted,field->key);
+        }
+        if (field->value){
+            json_quote_value_keys(field->value);
+        }
+    }
+    buf_free(quoted);
+}
 
-char* json_stringify_object(BUF(char* buffer),JsonObject* object);
+const JsonFormat json_format_compact = {JSON_FORMAT_COMPACT};
+const JsonFormat json_format_pretty = {JSON_FORMAT_PRETTY,2,' ',false};
 
-static char* json_stringify_value(char* buffer, JsonValue* value){
-    assert(value);
+// One open object or array on the printer stack
+typedef struct JsonPrintFrame{
+    JsonField** fields;     //object fields, NULL for an array or a shaped object
+    JsonShape* shape;       //keys of a shaped object
+    JsonValue** values;     //array elements or shaped object values
+    size_t index;
+    size_t count;
+    bool object;
+    bool single_line;       //items go on the same line as the bracket
+    bool sorted;            //fields is a sorted copy to free on close
+    JsonField* shaped_fields;   //fields built for sorting a shaped object, freed on close
+}JsonPrintFrame;
+
+typedef struct JsonPrinter{
+    const JsonFormat* format;
+    BUF(char* buffer);
+    BUF(JsonPrintFrame* stack);
+    BUF(char* indent);      //'\n' followed by indent characters, grown on demand
+}JsonPrinter;
+
+static void json_print_newline(JsonPrinter* printer,size_t depth){
+    size_t len = 1 + depth*printer->format->indent_width;
+    if (buf_len(printer->indent) < len){
+        if (!printer->indent){
+            buf_push(printer->indent,'\n');
+        }
+        buf_fit(printer->indent,len);
+        memset(buf_end(printer->indent),printer->format->indent_char,len - buf_len(printer->indent));
+        buf__hdr(printer->indent)->len = len;
+    }
+    buf_write(printer->buffer,printer->indent,len);
+}
+
+static int json_field_key_cmp(const void* a,const void* b){
+    JsonString ka = (*(JsonField* const*)a)->key;
+    JsonString kb = (*(JsonField* const*)b)->key;
+    int cmp = memcmp(ka.str,kb.str,ka.len < kb.len ? ka.len : kb.len);
+    return cmp ? cmp : (ka.len > kb.len) - (ka.len < kb.len);
+}
+
+static bool json_array_has_containers(JsonValue* array){
+    for (size_t i = 0; i < array->len; i++){
+        JsonType type = array->values[i]->type;
+        if (type == JSON_object || type == JSON_array || type == JSON_array_float || type == JSON_array_int){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void json_print_open_object(JsonPrinter* printer,JsonObject* object){
+    assert(object);
+    buf_push(printer->buffer,'{');
+    JsonPrintFrame frame = {0};
+    frame.object = true;
+    frame.fields = object->fields;
+    frame.shape = object->shape;
+    frame.values = object->values;
+    frame.count = object->fields_count;
+    frame.single_line = printer->format->mode == JSON_FORMAT_COMPACT;
+    if (printer->format->sort_keys && frame.count > 1){
+        JsonField** sorted = NULL;
+        if (object->shape){
+            for (size_t i = 0; i < frame.count; i++){
+                JsonString quoted = object->shape->quoted_keys ? object->shape->quoted_keys[i] : (JsonString){0};
+                buf_push(frame.shaped_fields,(JsonField){object->shape->keys[i],object->values[i],quoted});
+            }
+            for (size_t i = 0; i < frame.count; i++){
+                buf_push(sorted,frame.shaped_fields + i);
+            }
+        }else{
+            buf_fit(sorted,frame.count);
+            memcpy(sorted,object->fields,frame.count*sizeof(JsonField*));
+            buf__hdr(sorted)->len = frame.count;
+        }
+        qsort(sorted,frame.count,sizeof(JsonField*),json_field_key_cmp);
+        frame.fields = sorted;
+        frame.sorted = true;
+    }
+    buf_push(printer->stack,frame);
+}
+
+static void json_print_open_array(JsonPrinter* printer,JsonValue* array){
+    buf_push(printer->buffer,'[');
+    JsonPrintFrame frame = {0};
+    frame.values = array->values;
+    frame.count = array->len;
+    switch (printer->format->mode) {
+        case JSON_FORMAT_COMPACT:
+            frame.single_line = true;
+            break;
+        case JSON_FORMAT_PRETTY:
+            frame.single_line = !json_array_has_containers(array);
+            break;
+        case JSON_FORMAT_EXPANDED:
+            frame.single_line = false;
+            break;
+    }
+    buf_push(printer->stack,frame);
+}
+
+static char* json_write_int(BUF(char* buffer),int64_t val){
+    char digits[20];
+    char* it = digits + sizeof(digits);
+    uint64_t mag = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+    do {
+        *--it = (char)('0' + mag % 10);
+        mag /= 10;
+    } while (mag);
+    if (val < 0){
+        buf_push(buffer,'-');
+    }
+    buf_write(buffer,it,digits + sizeof(digits) - it);
+    return buffer;
+}
+
+// Formats straight into the buffer's spare capacity with the fewest digits that
+// read back as the same double, keeping a '.0' so it reads back as a float.
+// JSON has no NaN or infinity: they are written as null, callers that must
+// refuse them check isfinite first.
+static char* json_write_float(BUF(char* buffer),double val){
+    if (!isfinite(val)){
+        buf_write(buffer,"null",4);
+        return buffer;
+    }
+    buf_fit(buffer,buf_len(buffer) + 32);
+    char* out = buf_end(buffer);
+    int len = 0;
+    for (int precision = 15; precision <= 17; precision++){
+        len = snprintf(out,32,"%.*g",precision,val);
+        if (strtod(out,NULL) == val){
+            break;
+        }
+    }
+    if (!strpbrk(out,".e")){
+        memcpy(out + len,".0",3);
+        len += 2;
+    }
+    buf__hdr(buffer)->len += len;
+    return buffer;
+}
+
+// Packed arrays hold only numbers, so they are written in one loop, without a frame
+static void json_print_packed(JsonPrinter* printer,JsonValue* value){
+    size_t depth = buf_len(printer->stack);
+    bool expanded = printer->format->mode == JSON_FORMAT_EXPANDED;
+    buf_push(printer->buffer,'[');
+    for (size_t i = 0; i < value->len; i++){
+        if (i){
+            buf_push(printer->buffer,',');
+        }
+        if (expanded){
+            json_print_newline(printer,depth + 1);
+        }
+        if (value->type == JSON_array_int){
+            printer->buffer = json_write_int(printer->buffer,value->ints[i]);
+        }else{
+            printer->buffer = json_write_float(printer->buffer,value->floats[i]);
+        }
+    }
+    if (expanded && value->len){
+        json_print_newline(printer,depth);
+    }
+    buf_push(printer->buffer,']');
+}
+
+static void json_print_value(JsonPrinter* printer,JsonValue* value){
+    if (!value){
+        buf_write(printer->buffer,"null",4);
+        return;
+    }
     switch (value->type) {
         case JSON_number_float:
-            buf_printf(buffer,"%f",value->float_number);
+            printer->buffer = json_write_float(printer->buffer,value->float_number);
             break;
         case JSON_number_int:
-            buf_printf(buffer,"%d",value->int_number);
+            printer->buffer = json_write_int(printer->buffer,value->int_number);
             break;
-        case JSON_string:
-            buf_printf(buffer,"\"%s\"",value->string.str);
+        case JSON_number_raw: {
+            JsonString text = json_get_string(value);
+            buf_write(printer->buffer,text.str,text.len);
             break;
-        case JSON_array:
-            buf_printf(buffer,"[");
-            if(value->array.len){
-                for (JsonValue** it = value->array.values; it != value->array.values + (value->array.len - 1); it++){
-                    buffer = json_stringify_value(buffer,*it);
-                    buf_printf(buffer,",");
-                }
-                buffer = json_stringify_value(buffer,value->array.values[value->array.len - 1]);
-            }
-            buf_printf(buffer,"]");
+        }
+        case JSON_string: {
+            JsonString str = json_get_string(value);
+            printer->buffer = json_write_string(printer->buffer,str.str,str.len);
             break;
+        }
         case JSON_bool:
             if (value->boolean){
-                buf_printf(buffer,"true");
+                buf_write(printer->buffer,"true",4);
             }else{
-                buf_printf(buffer,"false");
+                buf_write(printer->buffer,"false",5);
             }
             break;
         case JSON_null:
-            buf_printf(buffer,"null");
+            buf_write(printer->buffer,"null",4);
+            break;
+        case JSON_array:
+            json_print_open_array(printer,value);
+            break;
+        case JSON_array_float:
+        case JSON_array_int:
+            json_print_packed(printer,value);
             break;
         case JSON_object:
-            buffer = json_stringify_object(buffer,value->object);
+            json_print_open_object(printer,value->object);
             break;
     }
-    return buffer;
 }
 
-static char* json_stringify_field(char* buffer,JsonField* field){
-    assert(field);
-    buf_printf(buffer,"\"%s\":",field->key);
-    return json_stringify_value(buffer,field->value);
+static void json_print_key(JsonPrinter* printer,JsonString key,JsonString quoted_key){
+    if (quoted_key.str){
+        buf_write(printer->buffer,quoted_key.str,quoted_key.len);
+    }else{
+        printer->buffer = json_write_string(printer->buffer,key.str,key.len);
+        buf_push(printer->buffer,':');
+    }
+    if (printer->format->mode != JSON_FORMAT_COMPACT){
+        buf_push(printer->buffer,' ');
+    }
 }
 
-char* json_stringify_object(BUF(char* buffer),JsonObject* object){
-    assert(object);
-    object->format_print ? buf_printf_newline(buffer) : 0;
-    buf_printf(buffer,"{");
-    if (object->fields_count){
-        object->format_print ? indent++ : 0;
-        for (JsonField** field = object->fields; field != object->fields + (object->fields_count-1); field++){
-            object->format_print ? buf_printf_newline(buffer) : 0;
-            buffer = json_stringify_field(buffer,*field);
-            buf_printf(buffer,",");
-        }
-        object->format_print ? buf_printf_newline(buffer) : 0;
-        buffer = json_stringify_field(buffer,object->fields[object->fields_count-1]);
-        object->format_print ? indent-- : 0;
-    }
-    object->format_print ? buf_printf_newline(buffer) : 0;
-    buf_printf(buffer,"}");
-    return buffer;
+// Prints without recursion: nested objects and arrays push a frame, which is
+// popped and closed once all of its items have been written
+char* json_stringify_format(BUF(char* buffer),JsonObject* object,const JsonFormat* format){
+    JsonPrinter printer = {.format = format ? format : &json_format_compact,.buffer = buffer,.stack = NULL,.indent = NULL};
+    json_print_open_object(&printer,object);
+    while (buf_len(printer.stack)){
+        size_t depth = buf_len(printer.stack);
+        JsonPrintFrame* frame = printer.stack + depth - 1;
+        if (frame->index == frame->count){
+            if (frame->count && !frame->single_line){
+                json_print_newline(&printer,depth - 1);
+            }
+            buf_push(printer.buffer,frame->object ? '}' : ']');
+            if (frame->sorted){
+                buf_free(frame->fields);
+                buf_free(frame->shaped_fields);
+            }
+            buf__hdr(printer.stack)->len--;
+            continue;
+        }
+        if (frame->index){
+            buf_push(printer.buffer,',');
+        }
+        if (!frame->single_line){
+            json_print_newline(&printer,depth);
+        }
+        JsonValue* value;
+        if (frame->object && frame->fields){
+            JsonField* field = frame->fields[frame->index++];
+            json_print_key(&printer,field->key,field->quoted_key);
+            value = field->value;
+        }else if (frame->object){
+            size_t i = frame->index++;
+            JsonShape* shape = frame->shape;
+            json_print_key(&printer,shape->keys[i],shape->quoted_keys ? shape->quoted_keys[i] : (JsonString){0});
+            value = frame->values[i];
+        }else{
+            value = frame->values[frame->index++];
+        }
+        json_print_value(&printer,value);   //may push, frame is invalid past this point
+    }
+    buf_free(printer.stack);
+    buf_free(printer.indent);
+    return printer.buffer;
+}
+
+static const JsonFormat* json_object_format(JsonObject* obj){
+    return obj->format_print ? &json_format_pretty : &json_format_compact;
 }
 
 char* json_stringify(JsonObject* obj){
-    char* buffer = json_stringify_object(NULL,obj);
-    char* returned = strdup(buffer);
+    char* buffer = json_stringify_format(NULL,obj,json_object_format(obj));
+    buf_push(buffer,0);
+    buf__hdr(buffer)->len--;
+    return buffer;
+}
+
+void json_fprintf_format(FILE* stream,JsonObject* obj,const JsonFormat* format){
+    char* buffer = json_stringify_format(NULL,obj,format);
+    fwrite(buffer,1,buf_len(buffer),stream);
     buf_free(buffer);
-    return returned;
 }
 
 void json_fprintf(FILE* stream,JsonObject* obj){
-    char* buffer = json_stringify_object(NULL,obj);
-    fprintf(stream,buffer);
-    buf_free(buffer);
+    json_fprintf_format(stream,obj,json_object_format(obj));
 }
@@ -0,0 +1,148 @@
+// Shapes: objects that share an ordered key list point at one JsonShape and
+// keep only their values. Shapes form a tree of key transitions, so the parser
+// finds the shape of an object one key at a time, comparing each key with the
+// transition the previous object took instead of hashing it.
+
+#define JSON_SHAPE_MAX_TRANSITIONS 32  //beyond this a shape's children are too varied to share
+
+Arena json_shape_arena;
+uint64_t json_shape_generation;
+JsonShape json_shape_root;
+BUF(JsonShape** json_shapes);   //every shape but the root, for json_free_shapes
+
+// Child of shape adding key, NULL when shape already has too many children
+static JsonShape* json_shape_child(JsonShape* shape,const char* key,size_t len){
+    for (JsonShape** it = shape->transitions; it != buf_end(shape->transitions); it++){
+        JsonShape* child = *it;
+        if (child->key.len == len && !memcmp(child->key.str,key,len)){
+            return child;
+        }
+    }
+    if (buf_len(shape->transitions) >= JSON_SHAPE_MAX_TRANSITIONS){
+        return NULL;
+    }
+    JsonShape* child = arena_calloc(&json_shape_arena,1,sizeof(JsonShape));
+    char* copy = arena_alloc(&json_shape_arena,len + 1);
+    memcpy(copy,key,len);
+    copy[len] = 0;
+    child->key = (JsonString){copy,len};
+    child->parent = shape;
+    child->count = shape->count + 1;
+    buf_push(shape->transitions,child);
+    buf_push(json_shapes,child);
+    return child;
+}
+
+// Lays out the keys and the slot index the first time an object ends with shape
+static JsonShape* json_shape_finish(JsonShape* shape){
+    if (shape->index || !shape->count){
+        return shape;
+    }
+    size_t count = shape->count;
+    shape->keys = arena_alloc(&json_shape_arena,count*sizeof(JsonString));
+    for (JsonShape* it = shape; it->parent; it = it->parent){
+        shape->keys[it->count - 1] = it->key;
+    }
+    shape->index_cap = 8;
+    while (shape->index_cap < 2*count){
+        shape->index_cap *= 2;
+    }
+    shape->index = arena_calloc(&json_shape_arena,shape->index_cap,sizeof(uint32_t));
+    shape->hash_seed = str_hash_get_seed();
+    for (size_t i = 0; i < count; i++){
+        JsonString key = shape->keys[i];
+        uint64_t hash = str_hash_with_seed(key.str,key.len,shape->hash_seed);
+        for (size_t slot = hash & (shape->index_cap - 1);; slot = (slot + 1) & (shape->index_cap - 1)){
+            if (!shape->index[slot]){
+                shape->index[slot] = (uint32_t)(i + 1);
+                break;
+            }
+            JsonString other = shape->keys[shape->index[slot] - 1];
+            if (other.len == key.len && !memcmp(other.str,key.str,key.len)){
+                shape->index[slot] = (uint32_t)(i + 1);
+                break;
+            }
+        }
+    }
+    return shape;
+}
+
+size_t json_shape_slot(const JsonShape* shape,const char* key,size_t len){
+    if (!shape->count){
+        return 0;
+    }
+    assert(shape->index);
+    uint64_t hash = str_hash_with_seed(key,len,shape->hash_seed);
+    for (size_t slot = hash & (shape->index_cap - 1);; slot = (slot + 1) & (shape->index_cap - 1)){
+        if (!shape->index[slot]){
+            return shape->count;
+        }
+        size_t i = shape->index[slot] - 1;
+        if (shape->keys[i].len == len && !memcmp(shape->keys[i].str,key,len)){
+            return i;
+        }
+    }
+}
+
+void json_free_shapes(){
+    for (JsonShape** it = json_shapes; it != buf_end(json_shapes); it++){
+        buf_free((*it)->transitions);
+    }
+    buf_free(json_shapes);
+    buf_free(json_shape_root.transitions);
+    memset(&json_shape_root,0,sizeof(json_shape_root));
+    arena_free(&json_shape_arena);
+    json_shape_generation++;
+}
+
+JsonString json_object_key(const JsonObject* obj,size_t i){
+    assert(i < obj->fields_count);
+    return obj->shape ? obj->shape->keys[i] : obj->fields[i]->key;
+}
+
+JsonValue* json_object_value(const JsonObject* obj,size_t i){
+    assert(i < obj->fields_count);
+    return obj->shape ? obj->values[i] : obj->fields[i]->value;
+}
+
+JsonValue* json_get(JsonObject* obj,const char* key){
+    if (obj->shape){
+        size_t slot = json_shape_slot(obj->shape,key,strlen(key));
+        return slot < obj->shape->count ? obj->values[slot] : NULL;
+    }
+    JsonField* field = json_find_field(obj,key);
+    return field ? field->value : NULL;
+}
+
+// Moves the first count values into fields keyed by shape, which becomes
+// NULL; used both on finished objects and on ones the parser gives up sharing.
+// Keys are copied into arena, since json_free_shapes may drop the shape first.
+static void json_object_unshare_values(Arena* arena,JsonObject* obj,const JsonShape* shape,JsonValue** values){
+    size_t count = shape->count;
+    obj->shape = NULL;
+    obj->values = NULL;
+    obj->values_arena = NULL;
+    obj->fields_count = 0;
+    obj->fields_map = arena_calloc(arena,1,sizeof(Map));
+    if (!count){
+        return;
+    }
+    json_object_reserve(obj,count);
+    JsonField* fields = arena_alloc(arena,count*sizeof(JsonField));
+    const JsonShape* it = shape;
+    for (size_t i = count; i-- > 0; it = it->parent){
+        fields[i].key = json_clone_string(arena,it->key);
+        fields[i].value = values[i];
+        fields[i].quoted_key = shape->quoted_keys ? json_clone_string(arena,shape->quoted_keys[i]) : (JsonString){0};
+    }
+    for (size_t i = 0; i < count; i++){
+        json_put_field(obj,fields + i);
+    }
+}
+
+void json_object_unshare(JsonObject* obj){
+    if (obj->shape){
+        assert(obj->values_arena);
+        json_object_unshare_values(obj->values_arena,obj,obj->shape,obj->values);
+    }
+}
@@ -0,0 +1,385 @@
+#define snap_at(image,offset,type) ((type*)((image) + (offset)))
+#define snap_ptr(node,offset,type) ((const type*)((const char*)(node) + (offset)))
+
+static size_t json_snap_reserve(char** image, size_t size){
+    size_t offset = ALIGN_UP(buf_len(*image), 8);
+    buf_fit(*image, offset + size);
+    memset(*image + buf_len(*image), 0, offset + size - buf_len(*image));
+    buf__hdr(*image)->len = offset + size;
+    return offset;
+}
+
+static size_t json_snap_write_string(char** image, JsonString str){
+    size_t offset = json_snap_reserve(image, sizeof(JsonSnapString) + str.len + 1);
+    JsonSnapString* snap_str = snap_at(*image,offset,JsonSnapString);
+    snap_str->len = str.len;
+    memcpy(snap_str->str, str.str, str.len);
+    return offset;
+}
+
+static size_t json_snap_write_object(char** image, JsonObject* obj);
+
+static void json_snap_write_value(char** image, size_t dst, JsonValue* value){
+    assert(value);
+    size_t payload = 0;
+    snap_at(*image,dst,JsonSnapValue)->type = value->type;
+    switch (value->type) {
+        case JSON_number_float:
+            snap_at(*image,dst,JsonSnapValue)->float_number = value->float_number;
+            break;
+        case JSON_number_int:
+            snap_at(*image,dst,JsonSnapValue)->int_number = value->int_number;
+            break;
+        case JSON_bool:
+            snap_at(*image,dst,JsonSnapValue)->boolean = value->boolean;
+            break;
+        case JSON_null:
+            break;
+        case JSON_number_raw:
+            if (json_number_text_is_integer(json_get_string(value))){
+                snap_at(*image,dst,JsonSnapValue)->type = JSON_number_int;
+                snap_at(*image,dst,JsonSnapValue)->int_number = json_number_as_int64(value);
+            }else{
+                snap_at(*image,dst,JsonSnapValue)->type = JSON_number_float;
+                snap_at(*image,dst,JsonSnapValue)->float_number = json_number_as_double(value);
+            }
+            break;
+        case JSON_string:
+            payload = json_snap_write_string(image,json_get_string(value));
+            snap_at(*image,dst,JsonSnapValue)->offset = payload - dst;
+            break;
+        case JSON_array:
+            payload = json_snap_reserve(image,sizeof(JsonSnapArray) + value->len*sizeof(JsonSnapValue));
+            snap_at(*image,payload,JsonSnapArray)->len = value->len;
+            for (size_t i = 0; i < value->len; i++){
+                json_snap_write_value(image,payload + offsetof(JsonSnapArray,values) + i*sizeof(JsonSnapValue),value->values[i]);
+            }
+            snap_at(*image,dst,JsonSnapValue)->offset = payload - dst;
+            break;
+        case JSON_array_float:
+        case JSON_array_int:
+            //snapshots keep one array layout, so packed arrays are boxed
+            snap_at(*image,dst,JsonSnapValue)->type = JSON_array;
+            payload = json_snap_reserve(image,sizeof(JsonSnapArray) + value->len*sizeof(JsonSnapValue));
+            snap_at(*image,payload,JsonSnapArray)->len = value->len;
+            for (size_t i = 0; i < value->len; i++){
+                JsonSnapValue* item = snap_at(*image,payload + offsetof(JsonSnapArray,values) + i*sizeof(JsonSnapValue),JsonSnapValue);
+                if (value->type == JSON_array_int){
+                    item->type = JSON_number_int;
+                    item->int_number = value->ints[i];
+                }else{
+                    item->type = JSON_number_float;
+                    item->float_number = value->floats[i];
+                }
+            }
+            snap_at(*image,dst,JsonSnapValue)->offset = payload - dst;
+            break;
+        case JSON_object:
+            payload = json_snap_write_object(image,value->object);
+            snap_at(*image,dst,JsonSnapValue)->offset = payload - dst;
+            break;
+    }
+}
+
+static size_t json_snap_write_object(char** image, JsonObject* obj){
+    assert(obj);
+    size_t count = obj->fields_count;
+    size_t index_cap = 0;
+    if (count){
+        index_cap = 16;
+        while (index_cap < 2*count){
+            index_cap *= 2;
+        }
+    }
+    size_t index_offset = offsetof(JsonSnapObject,fields) + count*sizeof(JsonSnapField);
+    size_t offset = json_snap_reserve(image,index_offset + index_cap*sizeof(uint32_t));
+    snap_at(*image,offset,JsonSnapObject)->fields_count = count;
+    snap_at(*image,offset,JsonSnapObject)->index_cap = index_cap;
+    snap_at(*image,offset,JsonSnapObject)->hash_seed = str_hash_get_seed();
+
+    for (size_t i = 0; i < count; i++){
+        JsonString field_key = json_object_key(obj,i);
+        size_t field_offset = offset + offsetof(JsonSnapObject,fields) + i*sizeof(JsonSnapField);
+        uint64_t hash = str_hash(field_key.str,field_key.len);
+        size_t key = json_snap_write_string(image,field_key);
+        snap_at(*image,field_offset,JsonSnapField)->hash = hash;
+        snap_at(*image,field_offset,JsonSnapField)->key = key - field_offset;
+        json_snap_write_value(image,field_offset + offsetof(JsonSnapField,value),json_object_value(obj,i));
+
+        //later duplicates replace earlier ones, as with json_get_field
+        uint32_t* index = snap_at(*image,offset + index_offset,uint32_t);
+        JsonSnapField* fields = snap_at(*image,offset,JsonSnapObject)->fields;
+        for (size_t slot = hash & (index_cap - 1);; slot = (slot + 1) & (index_cap - 1)){
+            if (!index[slot]){
+                index[slot] = (uint32_t)(i + 1);
+                break;
+            }
+            JsonSnapField* other = fields + index[slot] - 1;
+            if (other->hash == hash){
+                JsonString other_key = json_snap_key(other);
+                if (other_key.len == field_key.len && !memcmp(other_key.str,field_key.str,field_key.len)){
+                    index[slot] = (uint32_t)(i + 1);
+                    break;
+                }
+            }
+        }
+    }
+    return offset;
+}
+
+BUF(char*) json_snapshot_write(JsonObject* obj){
+    char* image = NULL;
+    size_t header = json_snap_reserve(&image,sizeof(JsonSnapHeader));
+    assert(header == 0);
+    size_t root = offsetof(JsonSnapHeader,root);
+    snap_at(image,root,JsonSnapValue)->type = JSON_object;
+    size_t payload = json_snap_write_object(&image,obj);
+    snap_at(image,root,JsonSnapValue)->offset = payload - root;
+
+    JsonSnapHeader* hdr = snap_at(image,0,JsonSnapHeader);
+    hdr->magic = JSON_SNAPSHOT_MAGIC;
+    hdr->version = JSON_SNAPSHOT_VERSION;
+    hdr->size = buf_len(image);
+    return image;
+}
+
+bool json_snapshot_save(JsonObject* obj,const char* path){
+    FILE* file = fopen(path,"wb");
+    if (!file){
+        return false;
+    }
+    char* image = json_snapshot_write(obj);
+    bool ok = fwrite(image,buf_len(image),1,file) == 1;
+    buf_free(image);
+    return fclose(file) == 0 && ok;
+}
+
+// Start of the payload a node refers to, checking that its first header bytes are
+// in the image; the writer puts every payload after its node, 8-byte aligned
+static bool json_snap_check_payload(size_t size,size_t node,int64_t offset,size_t header,size_t* at){
+    if (offset <= 0 || (uint64_t)offset > size - node || (node + offset) % 8){
+        return false;
+    }
+    *at = node + (size_t)offset;
+    return header <= size - *at;
+}
+
+static bool json_snap_check_string(const char* data,size_t size,size_t node,int64_t offset){
+    size_t at;
+    if (!json_snap_check_payload(size,node,offset,sizeof(JsonSnapString),&at)){
+        return false;
+    }
+    uint64_t len = ((const JsonSnapString*)(data + at))->len;
+    size_t room = size - at - sizeof(JsonSnapString);
+    return len < room && !data[at + sizeof(JsonSnapString) + len];
+}
+
+static bool json_snap_check_object(const char* data,size_t size,size_t at,size_t** pending,size_t* budget){
+    const JsonSnapObject* obj = (const JsonSnapObject*)(data + at);
+    size_t room = size - at - sizeof(JsonSnapObject);
+    if (obj->fields_count > room/sizeof(JsonSnapField) || obj->fields_count > *budget){
+        return false;
+    }
+    //lookups probe until an empty slot, so the index needs one
+    size_t index_at = at + offsetof(JsonSnapObject,fields) + obj->fields_count*sizeof(JsonSnapField);
+    if (!obj->fields_count ? obj->index_cap != 0 : (obj->index_cap <= obj->fields_count ||
+        (obj->index_cap & (obj->index_cap - 1)) || obj->index_cap > (size - index_at)/sizeof(uint32_t))){
+        return false;
+    }
+    const uint32_t* index = (const uint32_t*)(data + index_at);
+    bool empty = !obj->index_cap;
+    for (size_t slot = 0; slot < obj->index_cap; slot++){
+        if (index[slot] > obj->fields_count){
+            return false;
+        }
+        empty |= !index[slot];
+    }
+    if (!empty){
+        return false;
+    }
+    *budget -= obj->fields_count;
+    for (size_t i = 0; i < obj->fields_count; i++){
+        size_t field = at + offsetof(JsonSnapObject,fields) + i*sizeof(JsonSnapField);
+        if (!json_snap_check_string(data,size,field,((const JsonSnapField*)(data + field))->key)){
+            return false;
+        }
+        buf_push(*pending,field + offsetof(JsonSnapField,value));
+    }
+    return true;
+}
+
+// Walks every node once so the accessors can follow offsets unchecked. A valid
+// image never shares nodes, which bounds the walk by the number that fit in it.
+static bool json_snap_check_image(const char* data,size_t size){
+    BUF(size_t* pending) = NULL;  //offsets of the nodes left to check
+    size_t budget = size/sizeof(JsonSnapValue) - 1;
+    buf_push(pending,offsetof(JsonSnapHeader,root));
+    bool ok = true;
+    while (ok && buf_len(pending)){
+        size_t node = pending[--buf__hdr(pending)->len];
+        const JsonSnapValue* value = (const JsonSnapValue*)(data + node);
+        size_t at;
+        switch (value->type) {
+            case JSON_number_int:
+            case JSON_number_float:
+            case JSON_bool:
+            case JSON_null:
+                break;
+            case JSON_string:
+                ok = json_snap_check_string(data,size,node,value->offset);
+                break;
+            case JSON_array:
+                ok = json_snap_check_payload(size,node,value->offset,sizeof(JsonSnapArray),&at);
+                if (ok){
+                    uint64_t len = ((const JsonSnapArray*)(data + at))->len;
+                    ok = len <= (size - at - sizeof(JsonSnapArray))/sizeof(JsonSnapValue) && len <= budget;
+                    for (size_t i = 0; ok && i < len; i++){
+                        buf_push(pending,at + offsetof(JsonSnapArray,values) + i*sizeof(JsonSnapValue));
+                    }
+                    budget -= ok ? len : 0;
+                }
+                break;
+            case JSON_object:
+                ok = json_snap_check_payload(size,node,value->offset,sizeof(JsonSnapObject),&at) &&
+                     json_snap_check_object(data,size,at,&pending,&budget);
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    buf_free(pending);
+    return ok;
+}
+
+JsonSnapshot json_snapshot_open(const void* data,size_t size){
+    JsonSnapshot snapshot = {0};
+    const JsonSnapHeader* hdr = data;
+    if (!data || size < sizeof(JsonSnapHeader)){
+        return snapshot;
+    }
+    assert(data == ALIGN_DOWN_PTR(data,8));
+    if (hdr->magic != JSON_SNAPSHOT_MAGIC || hdr->version != JSON_SNAPSHOT_VERSION ||
+        hdr->size > size || hdr->size < sizeof(JsonSnapHeader)){
+        return snapshot;
+    }
+    if (hdr->root.type != JSON_object || !json_snap_check_image(data,hdr->size)){
+        return snapshot;
+    }
+    snapshot.data = data;
+    snapshot.size = hdr->size;
+    return snapshot;
+}
+
+JsonSnapshot json_snapshot_load(const char* path){
+    JsonSnapshot snapshot = {0};
+#ifndef _WIN32
+    int fd = open(path,O_RDONLY);
+    if (fd < 0){
+        return snapshot;
+    }
+    struct stat st;
+    if (fstat(fd,&st) != 0 || st.st_size == 0){
+        close(fd);
+        return snapshot;
+    }
+    void* data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (data == MAP_FAILED){
+        return snapshot;
+    }
+    snapshot = json_snapshot_open(data,st.st_size);
+    if (!snapshot.data){
+        munmap(data,st.st_size);
+        return snapshot;
+    }
+    snapshot.size = st.st_size;
+    snapshot.mapped = true;
+#else
+    FILE* file = fopen(path,"rb");
+    if (!file){
+        return snapshot;
+    }
+    fseek(file,0,SEEK_END);
+    long size = ftell(file);
+    fseek(file,0,SEEK_SET);
+    char* data = xmalloc(size > 0 ? size : 1);
+    if (size <= 0 || fread(data,size,1,file) != 1){
+        fclose(file);
+        free(data);
+        return snapshot;
+    }
+    fclose(file);
+    snapshot = json_snapshot_open(data,size);
+    if (!snapshot.data){
+        free(data);
+        return snapshot;
+    }
+    snapshot.mapped = true;
+#endif
+    return snapshot;
+}
+
+void json_snapshot_close(JsonSnapshot* snapshot){
+    if (!snapshot->data){
+        return;
+    }
+    if (snapshot->mapped){
+#ifndef _WIN32
+        munmap((void*)snapshot->data,snapshot->size);
+#else
+        free((void*)snapshot->data);
+#endif
+    }
+    snapshot->data = NULL;
+    snapshot->size = 0;
+}
+
+const JsonSnapObject* json_snapshot_root(JsonSnapshot snapshot){
+    if (!snapshot.data){
+        return NULL;
+    }
+    return json_snap_object(&((const JsonSnapHeader*)snapshot.data)->root);
+}
+
+JsonString json_snap_string(const JsonSnapValue* value){
+    assert(value->type == JSON_string);
+    const JsonSnapString* str = snap_ptr(value,value->offset,JsonSnapString);
+    return (JsonString){(char*)str->str,str->len};
+}
+
+const JsonSnapArray* json_snap_array(const JsonSnapValue* value){
+    assert(value->type == JSON_array);
+    return snap_ptr(value,value->offset,JsonSnapArray);
+}
+
+const JsonSnapObject* json_snap_object(const JsonSnapValue* value){
+    assert(value->type == JSON_object);
+    return snap_ptr(value,value->offset,JsonSnapObject);
+}
+
+JsonString json_snap_key(const JsonSnapField* field){
+    const JsonSnapString* key = snap_ptr(field,field->key,JsonSnapString);
+    return (JsonString){(char*)key->str,key->len};
+}
+
+const JsonSnapField* json_snap_get_field(const JsonSnapObject* obj,const char* key){
+    if (!obj->index_cap){
+        return NULL;
+    }
+    size_t len = strlen(key);
+    uint64_t hash = str_hash_with_seed(key,len,obj->hash_seed);
+    const uint32_t* index = (const uint32_t*)(obj->fields + obj->fields_count);
+    for (uint64_t slot = hash & (obj->index_cap - 1);; slot = (slot + 1) & (obj->index_cap - 1)){
+        if (!index[slot]){
+            return NULL;
+        }
+        const JsonSnapField* field = obj->fields + index[slot] - 1;
+        if (field->hash == hash){
+            JsonString field_key = json_snap_key(field);
+            if (field_key.len == len && !memcmp(field_key.str,key,len)){
+                return field;
+            }
+        }
+    }
+}
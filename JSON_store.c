@@ -0,0 +1,336 @@
+// Stores: a document published as a sequence of immutable versions. Readers
+// pin the current version without locks and see it unchanged until they leave.
+// The writer edits a draft that copies only the objects and arrays on the path
+// to each change and shares every other node with the version it started from,
+// then publishes it with a single atomic pointer swap. A replaced version is
+// freed once every reader that entered before the swap has left, tracked with
+// a global epoch that each reader announces on entry.
+
+static void json_version_adopt_value(JsonVersion* version,JsonValue* value);
+
+static void json_version_adopt_object(JsonVersion* version,JsonObject* obj){
+    //clones have fields and their own keys, the layout the copy-on-write edits rely on
+    assert(!obj->shape);
+    buf_push(version->objects,obj);
+    map_put(&version->copied,obj,obj);
+    for (size_t i = 0; i < obj->fields_count; i++){
+        if (obj->fields[i]->value){
+            json_version_adopt_value(version,obj->fields[i]->value);
+        }
+    }
+}
+
+// Registers the nodes of a value just cloned into the version's arena
+static void json_version_adopt_value(JsonVersion* version,JsonValue* value){
+    if (value->type == JSON_object){
+        map_put(&version->copied,value,value);
+        json_version_adopt_object(version,value->object);
+    }else if (value->type == JSON_array){
+        buf_push(version->arrays,value);
+        map_put(&version->copied,value,value);
+        for (size_t i = 0; i < value->len; i++){
+            json_version_adopt_value(version,value->values[i]);
+        }
+    }
+}
+
+static JsonValue* json_version_freeze(JsonVersion* version,JsonValue* value){
+    arena_reserve(&version->arena,json_value_footprint(value));
+    JsonValue* copy = json_clone_value(&version->arena,value);
+    json_version_adopt_value(version,copy);
+    return copy;
+}
+
+static bool json_version_owns(JsonVersion* version,const void* node){
+    return map_get(&version->copied,(void*)node) != NULL;
+}
+
+static JsonObject* json_version_own_object(JsonVersion* version,JsonObject* src){
+    if (json_version_owns(version,src)){
+        return src;
+    }
+    assert(!src->shape);
+    JsonObject* obj = arena_calloc(&version->arena,1,sizeof(JsonObject));
+    obj->format_print = src->format_print;
+    obj->fields_map = arena_calloc(&version->arena,1,sizeof(Map));
+    obj->fields = arena_buf(&version->arena,src->fields_count + 1,sizeof(JsonField*));
+    if (src->fields_count){
+        //fields are shared, so the index is copied as it is instead of rehashing every key
+        memcpy(obj->fields,src->fields,src->fields_count*sizeof(JsonField*));
+        buf__hdr(obj->fields)->len = src->fields_count;
+        obj->fields_count = src->fields_count;
+        Map* map = obj->fields_map;
+        size_t size = src->fields_map->cap*sizeof(MapEntry) + src->fields_map->cap + MAP_GROUP;
+        *map = *src->fields_map;
+        map->entries = xmalloc(size);
+        memcpy(map->entries,src->fields_map->entries,size);
+        map->ctrl = (uint8_t*)(map->entries + map->cap);
+    }
+    buf_push(version->objects,obj);
+    map_put(&version->copied,obj,obj);
+    return obj;
+}
+
+static JsonValue* json_version_own_value(JsonVersion* version,JsonValue* src){
+    if (json_version_owns(version,src)){
+        return src;
+    }
+    JsonValue* value = arena_alloc(&version->arena,sizeof(JsonValue));
+    *value = *src;
+    if (src->type == JSON_array){
+        value->values = arena_buf(&version->arena,src->len + 1,sizeof(JsonValue*));
+        memcpy(value->values,src->values,src->len*sizeof(JsonValue*));
+        buf__hdr(value->values)->len = src->len;
+        buf_push(version->arrays,value);
+    }
+    map_put(&version->copied,value,value);
+    return value;
+}
+
+static void json_version_put(JsonVersion* version,JsonObject* obj,JsonString key,uint64_t hash,JsonValue* value){
+    JsonField** indexed = (JsonField**)map_find_hashed(obj->fields_map,hash,json_field_match,&key);
+    JsonField* field = arena_alloc(&version->arena,sizeof(JsonField));
+    field->key = indexed ? (*indexed)->key : json_clone_string(&version->arena,key);
+    field->value = value;
+    field->quoted_key = (JsonString){0};
+    if (!indexed){
+        json_put_field_hashed(obj,field,hash);
+        return;
+    }
+    for (size_t i = 0; i < obj->fields_count; i++){
+        if (obj->fields[i] == *indexed){
+            obj->fields[i] = field;
+        }
+    }
+    *indexed = field;
+}
+
+static bool json_version_index(const char* key,size_t* index){
+    if (!isdigit((unsigned char)*key)){
+        return false;
+    }
+    char* end;
+    unsigned long long i = strtoull(key,&end,10);
+    *index = (size_t)i;
+    return !*end && i <= UINT32_MAX;
+}
+
+static JsonValue* json_version_edit_value(JsonVersion* version,JsonValue* node,const char** path,size_t depth,JsonValue* value);
+
+// Object holding the edit at path, obj itself when it was changed in place, NULL when path is missing
+static JsonObject* json_version_edit_object(JsonVersion* version,JsonObject* obj,const char** path,size_t depth,JsonValue* value){
+    JsonString key = json_string(path[0]);
+    uint64_t hash = str_hash(key.str,key.len);
+    JsonField** indexed = (JsonField**)map_find_hashed(obj->fields_map,hash,json_field_match,&key);
+    if (depth > 1){
+        if (!indexed || !(*indexed)->value){
+            return NULL;
+        }
+        JsonValue* child = json_version_edit_value(version,(*indexed)->value,path + 1,depth - 1,value);
+        if (!child || child == (*indexed)->value){
+            return child ? obj : NULL;
+        }
+        value = child;
+    }else if (!value && !indexed){
+        return NULL;
+    }
+    obj = json_version_own_object(version,obj);
+    if (value){
+        json_version_put(version,obj,key,hash,value);
+    }else{
+        //the values may still be shared with earlier versions
+        json_remove_fields(obj,key.str,false);
+    }
+    return obj;
+}
+
+static JsonValue* json_version_edit_value(JsonVersion* version,JsonValue* node,const char** path,size_t depth,JsonValue* value){
+    if (node->type == JSON_object){
+        JsonObject* obj = json_version_edit_object(version,node->object,path,depth,value);
+        if (!obj || obj == node->object){
+            return obj ? node : NULL;
+        }
+        node = json_version_own_value(version,node);
+        node->object = obj;
+        return node;
+    }
+    //scalars and packed arrays have no members to edit
+    size_t i;
+    if (node->type != JSON_array || !json_version_index(path[0],&i) || i > node->len ||
+        (i == node->len && (depth > 1 || !value))){
+        return NULL;
+    }
+    if (depth > 1){
+        JsonValue* child = json_version_edit_value(version,node->values[i],path + 1,depth - 1,value);
+        if (!child || child == node->values[i]){
+            return child ? node : NULL;
+        }
+        value = child;
+    }
+    node = json_version_own_value(version,node);
+    if (!value){
+        //the element may still be shared with earlier versions
+        json_values_erase(node->values,i);
+        node->len--;
+    }else if (i == node->len){
+        json_value_array_push(node,value);
+    }else{
+        node->values[i] = value;
+    }
+    return node;
+}
+
+bool json_version_set(JsonVersion* draft,const char** path,size_t depth,JsonValue* value){
+    assert(draft->copied.cap && value);
+    if (!depth && value->type != JSON_object){
+        return false;
+    }
+    JsonValue* copy = json_version_freeze(draft,value);
+    JsonObject* root = depth ? json_version_edit_object(draft,draft->root,path,depth,copy) : copy->object;
+    if (!root){
+        return false;
+    }
+    draft->root = root;
+    return true;
+}
+
+bool json_version_remove(JsonVersion* draft,const char** path,size_t depth){
+    assert(draft->copied.cap);
+    JsonObject* root = depth ? json_version_edit_object(draft,draft->root,path,depth,NULL) : NULL;
+    if (!root){
+        return false;
+    }
+    draft->root = root;
+    return true;
+}
+
+static JsonVersion* json_version_new(JsonVersion* base){
+    JsonVersion* version = xcalloc(1,sizeof(JsonVersion));
+    version->refs = 1;
+    map_reserve(&version->copied,0);
+    if (base && base->chain < JSON_STORE_MAX_CHAIN){
+        version->base = base;
+        version->chain = base->chain + 1;
+        version->root = base->root;
+        base->refs++;
+    }
+    return version;
+}
+
+static void json_version_release(JsonVersion* version){
+    while (version && --version->refs == 0){
+        JsonVersion* base = version->base;
+        for (JsonObject** it = version->objects; it != buf_end(version->objects); it++){
+            buf_free((*it)->fields);
+            free((*it)->fields_map->entries);
+        }
+        for (JsonValue** it = version->arrays; it != buf_end(version->arrays); it++){
+            buf_free((*it)->values);
+        }
+        buf_free(version->objects);
+        buf_free(version->arrays);
+        free(version->copied.entries);
+        arena_free(&version->arena);
+        free(version);
+        version = base;
+    }
+}
+
+// Full copy of root into the version, which then shares nothing
+static void json_version_copy_root(JsonVersion* version,JsonObject* root){
+    JsonValue wrapper = {0};
+    wrapper.type = JSON_object;
+    wrapper.object = root;
+    version->root = json_version_freeze(version,&wrapper)->object;
+}
+
+void json_store_init(JsonStore* store,JsonObject* doc){
+    memset(store,0,sizeof(JsonStore));
+    for (size_t i = 0; i < JSON_STORE_MAX_READERS; i++){
+        store->readers[i].epoch = JSON_STORE_IDLE;
+    }
+    JsonVersion* version = json_version_new(NULL);
+    json_version_copy_root(version,doc);
+    json_store_publish(store,version);
+}
+
+JsonVersion* json_store_edit(JsonStore* store){
+    JsonVersion* base = store->current;
+    JsonVersion* draft = json_version_new(base);
+    if (!draft->base){
+        json_version_copy_root(draft,base->root);
+    }
+    return draft;
+}
+
+void json_version_discard(JsonVersion* draft){
+    json_version_release(draft);
+}
+
+void json_store_publish(JsonStore* store,JsonVersion* draft){
+    free(draft->copied.entries);
+    draft->copied = (Map){0};
+    draft->number = store->current ? store->current->number + 1 : 1;
+    JsonVersion* prev = json_atomic_exchange_ptr(&store->current,draft);
+    if (prev){
+        //readers that entered before this epoch ends may still hold prev
+        prev->retired = json_atomic_fetch_add_u64(&store->epoch,1);
+        buf_push(store->retired,prev);
+    }
+    json_store_reclaim(store);
+}
+
+size_t json_store_reclaim(JsonStore* store){
+    uint64_t oldest = JSON_STORE_IDLE;
+    for (size_t i = 0; i < JSON_STORE_MAX_READERS; i++){
+        oldest = MIN(oldest,json_atomic_load_u64(&store->readers[i].epoch));
+    }
+    size_t kept = 0, freed = 0;
+    for (size_t i = 0; i < buf_len(store->retired); i++){
+        JsonVersion* version = store->retired[i];
+        if (version->retired < oldest){
+            json_version_release(version);
+            freed++;
+        }else{
+            store->retired[kept++] = version;
+        }
+    }
+    if (store->retired){
+        buf__hdr(store->retired)->len = kept;
+    }
+    return freed;
+}
+
+void json_store_free(JsonStore* store){
+    for (JsonVersion** it = store->retired; it != buf_end(store->retired); it++){
+        json_version_release(*it);
+    }
+    buf_free(store->retired);
+    json_version_release(store->current);
+    store->current = NULL;
+}
+
+JsonStoreReader* json_store_reader(JsonStore* store){
+    for (size_t i = 0; i < JSON_STORE_MAX_READERS; i++){
+        if (json_atomic_cas_u32(&store->readers[i].claimed,0,1)){
+            return store->readers + i;
+        }
+    }
+    return NULL;
+}
+
+void json_store_reader_release(JsonStoreReader* reader){
+    assert(reader->epoch == JSON_STORE_IDLE);
+    json_atomic_store_u32(&reader->claimed,0);
+}
+
+JsonVersion* json_store_enter(JsonStore* store,JsonStoreReader* reader){
+    assert(reader->epoch == JSON_STORE_IDLE);
+    //announce the epoch before loading the version: a version replaced in this epoch or later stays alive
+    json_atomic_store_u64(&reader->epoch,json_atomic_load_u64(&store->epoch));
+    return json_atomic_load_ptr(&store->current);
+}
+
+void json_store_leave(JsonStoreReader* reader){
+    json_atomic_store_u64(&reader->epoch,JSON_STORE_IDLE);
+}
@@ -69,16 +69,22 @@ char *buf__printf(char *buf, const char *fmt, ...);
 
 #define buf__hdr(b) ((BufHdr *)((char *)(b) - offsetof(BufHdr, buf)))
 
+// Buffers carved out of an arena have this bit set in cap: they are never
+// freed, and growing them copies into a fresh malloc'd buffer instead.
+#define BUF_ARENA_FLAG ((size_t)1 << (8*sizeof(size_t) - 1))
+
 #define buf_len(b) ((b) ? buf__hdr(b)->len : 0)
-#define buf_cap(b) ((b) ? buf__hdr(b)->cap : 0)
+#define buf_cap(b) ((b) ? buf__hdr(b)->cap & ~BUF_ARENA_FLAG : 0)
+#define buf_owned(b) ((b) && !(buf__hdr(b)->cap & BUF_ARENA_FLAG))
 #define buf_end(b) ((b) + buf_len(b))
 #define buf_sizeof(b) ((b) ? buf_len(b)*sizeof(*b) : 0)
 #define buf_fits(b,n) (buf_cap(b)-buf_len(b) > (n) ? 1 : 0)
 
-#define buf_free(b) ((b) ? (free(buf__hdr(b)), (b) = NULL) : 0)
+#define buf_free(b) ((b) ? (buf_owned(b) ? free(buf__hdr(b)) : (void)0, (b) = NULL) : 0)
 #define buf_fit(b, n) ((n) <= buf_cap(b) ? 0 : ((b) = buf__grow((b), (n), sizeof(*(b)))))
 #define buf_push(b, ...) (buf_fit((b), 1 + buf_len(b)), (b)[buf__hdr(b)->len++] = (__VA_ARGS__))
 #define buf_printf(b, ...) ((b) = buf__printf((b), __VA_ARGS__))
+#define buf_write(b, data, n) ((n) ? (buf_fit((b), buf_len(b) + (n)), memcpy(buf_end(b), (data), (n)), buf__hdr(b)->len += (n)) : 0)
 #define buf_clear(b) ((b) ? buf__hdr(b)->len = 0 : 0)
 
 
@@ -89,7 +95,11 @@ void *buf__grow(const void *buf, size_t new_len, size_t elem_size) {
     assert(new_cap <= (SIZE_MAX - offsetof(BufHdr, buf))/elem_size);
     size_t new_size = offsetof(BufHdr, buf) + new_cap*elem_size;
     BufHdr *new_hdr;
-    if (buf) {
+    if (buf && !buf_owned(buf)) {
+        new_hdr = xmalloc(new_size);
+        new_hdr->len = buf_len(buf);
+        memcpy(new_hdr->buf, buf, buf_len(buf)*elem_size);
+    } else if (buf) {
         new_hdr = xrealloc(buf__hdr(buf), new_size);
     } else {
         new_hdr = xmalloc(new_size);
@@ -119,23 +129,85 @@ char *buf__printf(char *buf, const char *fmt, ...) {
 
 // Arena allocator
 
+// Block sizes double from ARENA_BLOCK_SIZE up to ARENA_MAX_BLOCK_SIZE, so a large
+// document takes a few dozen blocks. Blocks from ARENA_MMAP_THRESHOLD up are mapped
+// directly, aligned to huge pages and advised as such, and arena_reset hands their
+// pages back to the OS while keeping the blocks for reuse.
+
+typedef struct ArenaBlock {
+    char *ptr;
+    size_t size;
+    bool mapped;    // from mmap rather than xmalloc
+} ArenaBlock;
+
 typedef struct Arena {
     char *ptr;
     char *end;
-    char **blocks;
+    ArenaBlock *blocks;
+    size_t used;        // blocks allocated from since the last reset, the rest are kept for reuse
+    size_t next_size;   // of the next new block, 0 before the first one
 } Arena;
 
-#define EMPTY_ARENA {NULL,NULL,NULL}
+#define EMPTY_ARENA {NULL,NULL,NULL,0,0}
 
 #define ARENA_ALIGNMENT 8
 #define ARENA_BLOCK_SIZE 1024*1024
+#define ARENA_MAX_BLOCK_SIZE (64*1024*1024)
+#define ARENA_MMAP_THRESHOLD (4*1024*1024)
+#define ARENA_HUGE_PAGE (2*1024*1024)
+
+static void arena_add_block(Arena *arena, size_t size) {
+    ArenaBlock block = {NULL, size, false};
+#ifndef _WIN32
+    if (size >= ARENA_MMAP_THRESHOLD) {
+        // over-map by a huge page so the block can start on a huge page boundary
+        size = ALIGN_UP(size, ARENA_HUGE_PAGE);
+        char *raw = mmap(NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            char *ptr = ALIGN_UP_PTR(raw, ARENA_HUGE_PAGE);
+            if (ptr != raw) {
+                munmap(raw, ptr - raw);
+            }
+            if (ptr + size != raw + size + ARENA_HUGE_PAGE) {
+                munmap(ptr + size, raw + size + ARENA_HUGE_PAGE - (ptr + size));
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+            block = (ArenaBlock){ptr, size, true};
+        }
+    }
+#endif
+    if (!block.ptr) {
+        block.ptr = xmalloc(block.size);
+    }
+    buf_push(arena->blocks, block);
+    arena->used = buf_len(arena->blocks);
+    arena->ptr = block.ptr;
+    arena->end = block.ptr + block.size;
+}
 
+// Moves to the next block kept by arena_reset that fits size, skipping smaller ones
+static bool arena_reuse(Arena *arena, size_t size) {
+    while (arena->used < buf_len(arena->blocks)) {
+        ArenaBlock *block = arena->blocks + arena->used++;
+        if (block->size >= size) {
+            arena->ptr = block->ptr;
+            arena->end = block->ptr + block->size;
+            return true;
+        }
+    }
+    return false;
+}
 
 void arena_grow(Arena *arena, size_t min_size) {
-    size_t size = ALIGN_UP(MAX(ARENA_BLOCK_SIZE, min_size), ARENA_ALIGNMENT);
-    arena->ptr = xmalloc(size);
-    arena->end = arena->ptr + size;
-    buf_push(arena->blocks, arena->ptr);
+    min_size = ALIGN_UP(min_size, ARENA_ALIGNMENT);
+    if (arena_reuse(arena, min_size)) {
+        return;
+    }
+    size_t size = arena->next_size ? arena->next_size : ARENA_BLOCK_SIZE;
+    arena->next_size = MIN(2*size, ARENA_MAX_BLOCK_SIZE);
+    arena_add_block(arena, MAX(size, min_size));
 }
 
 void *arena_alloc(Arena *arena, size_t size) {
@@ -156,10 +228,52 @@ void* arena_calloc(Arena* arena,size_t count,size_t size){
     return ptr;
 }
 
+void arena_reserve(Arena *arena, size_t size) {
+    if (size > (size_t)(arena->end - arena->ptr)) {
+        size = ALIGN_UP(size, ARENA_ALIGNMENT);
+        if (!arena_reuse(arena, size)) {
+            arena_add_block(arena, size);
+        }
+    }
+}
+
+// Forgets every allocation but keeps the blocks; mapped ones are emptied and refault as zero pages
+void arena_reset(Arena *arena) {
+#ifndef _WIN32
+    for (ArenaBlock *it = arena->blocks; it != buf_end(arena->blocks); it++) {
+        if (it->mapped) {
+            madvise(it->ptr, it->size, MADV_DONTNEED);
+        }
+    }
+#endif
+    arena->used = 0;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena_reuse(arena, 0);
+}
+
 void arena_free(Arena *arena) {
-    for (char **it = arena->blocks; it != buf_end(arena->blocks); it++) {
-        free(*it);
+    for (ArenaBlock *it = arena->blocks; it != buf_end(arena->blocks); it++) {
+#ifndef _WIN32
+        if (it->mapped) {
+            munmap(it->ptr, it->size);
+            continue;
+        }
+#endif
+        free(it->ptr);
     }
+    buf_free(arena->blocks);
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->used = 0;
+    arena->next_size = 0;
+}
+
+void *arena_buf(Arena *arena, size_t cap, size_t elem_size) {
+    BufHdr *hdr = arena_alloc(arena, offsetof(BufHdr, buf) + cap*elem_size);
+    hdr->len = 0;
+    hdr->cap = cap | BUF_ARENA_FLAG;
+    return hdr->buf;
 }
 
 char* arena_strdup(Arena* arena,const char* src, size_t length){
@@ -171,18 +285,30 @@ char* arena_strdup(Arena* arena,const char* src, size_t length){
 
 
 
+// Map: Swiss-table style open addressing keyed by 64-bit hashes. A control
+// byte per slot holds 7 bits of the hash (or EMPTY/DELETED), and lookups
+// compare a whole group of 16 control bytes at once before touching entries.
+// Several entries may share a hash; map_find_hashed tells them apart with a
+// match callback, so callers never need collision chains.
+
+#define MAP_GROUP 16
+#define MAP_EMPTY 0x80
+#define MAP_DELETED 0xFE
+
 typedef struct MapEntry {
-    void *key;
-    void *val;
     uint64_t hash;
+    void *val;
 } MapEntry;
 
 typedef struct Map {
-    MapEntry *entries;
+    MapEntry *entries;  // single allocation, followed by cap + MAP_GROUP control bytes
+    uint8_t *ctrl;
     size_t len;
+    size_t deleted;
     size_t cap;
 } Map;
 
+typedef bool MapMatchFunc(const void *val, const void *ctx);
 
 uint64_t uint64_hash(uint64_t x) {
     x *= 0xff51afd7ed558ccdul;
@@ -194,119 +320,379 @@ uint64_t ptr_hash(void *ptr) {
     return uint64_hash((uintptr_t)ptr);
 }
 
+// Sequentially consistent atomics, the u32 ones acquire/release
+#ifdef _MSC_VER
+#define json_atomic_load_ptr(p) _InterlockedCompareExchangePointer((void* volatile*)(p),NULL,NULL)
+#define json_atomic_exchange_ptr(p,v) _InterlockedExchangePointer((void* volatile*)(p),(v))
+#define json_atomic_load_u64(p) ((uint64_t)_InterlockedCompareExchange64((volatile long long*)(p),0,0))
+#define json_atomic_store_u64(p,v) _InterlockedExchange64((volatile long long*)(p),(long long)(v))
+#define json_atomic_fetch_add_u64(p,v) ((uint64_t)_InterlockedExchangeAdd64((volatile long long*)(p),(long long)(v)))
+#define json_atomic_load_u32(p) ((uint32_t)_InterlockedCompareExchange((volatile long*)(p),0,0))
+#define json_atomic_store_u32(p,v) _InterlockedExchange((volatile long*)(p),(long)(v))
+#define json_atomic_cas_u32(p,old,v) (_InterlockedCompareExchange((volatile long*)(p),(long)(v),(long)(old)) == (long)(old))
+#else
+#define json_atomic_load_ptr(p) __atomic_load_n((p),__ATOMIC_SEQ_CST)
+#define json_atomic_exchange_ptr(p,v) __atomic_exchange_n((p),(v),__ATOMIC_SEQ_CST)
+#define json_atomic_load_u64(p) __atomic_load_n((p),__ATOMIC_SEQ_CST)
+#define json_atomic_store_u64(p,v) __atomic_store_n((p),(v),__ATOMIC_SEQ_CST)
+#define json_atomic_fetch_add_u64(p,v) __atomic_fetch_add((p),(v),__ATOMIC_SEQ_CST)
+#define json_atomic_load_u32(p) __atomic_load_n((p),__ATOMIC_ACQUIRE)
+#define json_atomic_store_u32(p,v) __atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#define json_atomic_cas_u32(p,old,v) __extension__({uint32_t expected = (old); \
+    __atomic_compare_exchange_n((p),&expected,(v),false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED);})
+#endif
+
+// String hash: wyhash-style, reading 8 bytes at a time and mixing with a
+// 64x64->128 multiply. Keys longer than 48 bytes run three independent lanes.
+// The seed is random per process so colliding keys can't be precomputed.
+
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static inline void hash_mul128(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    hash_mul128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t _str_hash_seeded(const char *str, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)str;
+    uint64_t a, b;
+    seed ^= hash_mix(seed ^ HASH_P0, HASH_P1);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (hash_read32(p) << 32) | hash_read32(p + ((len >> 3) << 2));
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read64(p + 16) ^ HASH_P2, hash_read64(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read64(p + 32) ^ HASH_P3, hash_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ HASH_P1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+    a ^= HASH_P1;
+    b ^= seed;
+    hash_mul128(&a, &b);
+    return hash_mix(a ^ HASH_P0 ^ len, b ^ HASH_P1);
+}
+
+typedef enum StrHashSeedState {
+    STR_HASH_SEED_UNSET,
+    STR_HASH_SEED_WRITING,  //another thread is storing the seed
+    STR_HASH_SEED_SET,      //set by str_hash_init, can still change
+    STR_HASH_SEED_READ,     //something has hashed with it, fixed from now on
+} StrHashSeedState;
+
+uint64_t str_hash_seed;
+uint32_t str_hash_seed_state;
+
+// Fails once anything has hashed: maps and cached hashes built with the old
+// seed would go stale.
+bool str_hash_init(uint64_t seed) {
+    for (;;) {
+        uint32_t state = json_atomic_load_u32(&str_hash_seed_state);
+        if (state == STR_HASH_SEED_READ) {
+            return false;
+        }
+        if (state != STR_HASH_SEED_WRITING && json_atomic_cas_u32(&str_hash_seed_state, state, STR_HASH_SEED_WRITING)) {
+            str_hash_seed = seed;
+            json_atomic_store_u32(&str_hash_seed_state, STR_HASH_SEED_SET);
+            return true;
+        }
+    }
+}
+
+uint64_t str_hash_random_seed() {
+    uint64_t seed = 0;
+#ifndef _WIN32
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+            seed = 0;
+        }
+        close(fd);
+    }
+#endif
+    if (!seed) {
+        seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uintptr_t)&seed;
+    }
+    return seed;
+}
+
+uint64_t str_hash_get_seed() {
+    //the first read fixes the seed, picking a random one when none was set
+    for (;;) {
+        uint32_t state = json_atomic_load_u32(&str_hash_seed_state);
+        if (state == STR_HASH_SEED_READ) {
+            return str_hash_seed;
+        }
+        if (state == STR_HASH_SEED_UNSET && json_atomic_cas_u32(&str_hash_seed_state, state, STR_HASH_SEED_WRITING)) {
+            str_hash_seed = str_hash_random_seed();
+            json_atomic_store_u32(&str_hash_seed_state, STR_HASH_SEED_READ);
+        } else if (state == STR_HASH_SEED_SET) {
+            json_atomic_cas_u32(&str_hash_seed_state, state, STR_HASH_SEED_READ);
+        }
+    }
+}
+
 uint64_t _str_hash(const char *str, size_t len) {
-    uint64_t fnv_init = 14695981039346656037ull;
-    uint64_t fnv_mul = 1099511628211ull;
-    uint64_t h = fnv_init;
-    for (size_t i = 0; i < len; i++) {
-        h ^= str[i];
-        h *= fnv_mul;
+    return _str_hash_seeded(str, len, str_hash_get_seed());
+}
+
+#define str_hash(str,len) (_str_hash(str,len) | 1)
+#define str_hash_with_seed(str,len,seed) (_str_hash_seeded(str,len,seed) | 1)
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+
+static inline uint32_t map_group_match(const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+}
+
+static inline uint32_t map_group_free(const uint8_t *ctrl) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+static inline uint32_t map_group_match(const uint8_t *ctrl, uint8_t h2) {
+    uint32_t bits = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] == h2) << i;
     }
-    return h;
+    return bits;
 }
 
-#define str_hash(str,len) _str_hash(str,len) | 1
+static inline uint32_t map_group_free(const uint8_t *ctrl) {
+    uint32_t bits = 0;
+    for (int i = 0; i < MAP_GROUP; i++) {
+        bits |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return bits;
+}
+#endif
+
+static inline int map_first_bit(uint32_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(bits);
+#else
+    int i = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+#define map_h1(hash) ((size_t)((hash) >> 7))
+#define map_h2(hash) ((uint8_t)((hash) >> 57))
+
+static inline void map_set_ctrl(Map *map, size_t i, uint8_t ctrl) {
+    map->ctrl[i] = ctrl;
+    if (i < MAP_GROUP) {
+        map->ctrl[map->cap + i] = ctrl;
+    }
+}
 
-void *map_get_hashed(Map *map, void *key, uint64_t hash) {
+void **map_find_hashed(Map *map, uint64_t hash, MapMatchFunc *match, const void *ctx) {
     if (map->len == 0) {
         return NULL;
     }
     assert(IS_POW2(map->cap));
-    uint32_t i = (uint32_t)(hash & (map->cap - 1));
-    assert(map->len < map->cap);
-    for (;;) {
-        MapEntry *entry = map->entries + i;
-        if (entry->key == key) {
-            return entry->val;
-        } else if (!entry->key) {
-            return NULL;
+    size_t mask = map->cap - 1;
+    size_t pos = map_h1(hash) & mask;
+    uint8_t h2 = map_h2(hash);
+    for (size_t step = MAP_GROUP;; step += MAP_GROUP) {
+        const uint8_t *ctrl = map->ctrl + pos;
+        for (uint32_t bits = map_group_match(ctrl, h2); bits; bits &= bits - 1) {
+            MapEntry *entry = map->entries + ((pos + map_first_bit(bits)) & mask);
+            if (entry->hash == hash && (!match || match(entry->val, ctx))) {
+                return &entry->val;
+            }
         }
-        i++;
-        if (i == map->cap) {
-            i = 0;
+        if (map_group_match(ctrl, MAP_EMPTY)) {
+            return NULL;
         }
+        pos = (pos + step) & mask;
     }
-    return NULL;
 }
 
-void **map_put_hashed(Map *map, void *key, void *val, uint64_t hash);
+void *map_get_hashed(Map *map, uint64_t hash) {
+    void **val = map_find_hashed(map, hash, NULL, NULL);
+    return val ? *val : NULL;
+}
+
+static MapEntry *map_claim_slot(Map *map, uint64_t hash) {
+    size_t mask = map->cap - 1;
+    size_t pos = map_h1(hash) & mask;
+    for (size_t step = MAP_GROUP;; step += MAP_GROUP) {
+        uint32_t bits = map_group_free(map->ctrl + pos);
+        if (bits) {
+            size_t i = (pos + map_first_bit(bits)) & mask;
+            if (map->ctrl[i] == MAP_DELETED) {
+                map->deleted--;
+            }
+            map_set_ctrl(map, i, map_h2(hash));
+            map->len++;
+            MapEntry *entry = map->entries + i;
+            entry->hash = hash;
+            return entry;
+        }
+        pos = (pos + step) & mask;
+    }
+}
 
 void map_grow(Map *map, size_t new_cap) {
-    new_cap = MAX(16, new_cap);
+    new_cap = MAX(MAP_GROUP, new_cap);
+    assert(IS_POW2(new_cap));
     Map new_map = {
-            .entries = xcalloc(new_cap, sizeof(MapEntry)),
+            .entries = xmalloc(new_cap*sizeof(MapEntry) + new_cap + MAP_GROUP),
             .cap = new_cap
     };
+    new_map.ctrl = (uint8_t *)(new_map.entries + new_cap);
+    memset(new_map.ctrl, MAP_EMPTY, new_cap + MAP_GROUP);
     for (size_t i = 0; i < map->cap; i++) {
-        MapEntry *entry = map->entries + i;
-        if (entry->key) {
-            map_put_hashed(&new_map, entry->key, entry->val, entry->hash);
+        if (!(map->ctrl[i] & MAP_EMPTY)) {
+            map_claim_slot(&new_map, map->entries[i].hash)->val = map->entries[i].val;
         }
     }
     free(map->entries);
     *map = new_map;
 }
 
-void **map_put_hashed(Map *map, void *key, void *val, uint64_t hash) {
-    assert(key);
+// Always adds a new entry, even if one with the same hash exists
+void **map_insert_hashed(Map *map, uint64_t hash, void *val) {
     assert(val);
-    if (2*map->len >= map->cap) {
-        map_grow(map, 2*map->cap);
+    if (8*(map->len + map->deleted + 1) > 7*map->cap) {
+        map_grow(map, map->len + 1 > map->cap/2 ? 2*map->cap : map->cap);
     }
-    assert(2*map->len < map->cap);
-    assert(IS_POW2(map->cap));
-    uint32_t i = (uint32_t)(hash & (map->cap - 1));
-    for (;;) {
-        MapEntry *entry = map->entries + i;
-        if (!entry->key) {
-            map->len++;
-            entry->key = key;
-            entry->val = val;
-            entry->hash = hash;
-            return &entry->val;
-        } else if (entry->key == key) {
-            entry->val = val;
-            return &entry->val;
-        }
-        i++;
-        if (i == map->cap) {
-            i = 0;
-        }
+    MapEntry *entry = map_claim_slot(map, hash);
+    entry->val = val;
+    return &entry->val;
+}
+
+void **map_put_hashed(Map *map, uint64_t hash, void *val) {
+    void **slot = map_find_hashed(map, hash, NULL, NULL);
+    if (slot) {
+        *slot = val;
+        return slot;
+    }
+    return map_insert_hashed(map, hash, val);
+}
+
+// Leaves a tombstone, so probes for other entries still run past the slot
+bool map_remove_hashed(Map *map, uint64_t hash, MapMatchFunc *match, const void *ctx) {
+    void **val = map_find_hashed(map, hash, match, ctx);
+    if (!val) {
+        return false;
+    }
+    size_t i = (MapEntry *)((char *)val - offsetof(MapEntry, val)) - map->entries;
+    map_set_ctrl(map, i, MAP_DELETED);
+    map->len--;
+    map->deleted++;
+    return true;
+}
+
+void map_reserve(Map *map, size_t count) {
+    size_t new_cap = MAP_GROUP;
+    while (7*new_cap < 8*(count + 1)) {
+        new_cap *= 2;
+    }
+    if (new_cap > map->cap) {
+        map_grow(map, new_cap);
     }
 }
 
+// ptr_hash is a bijection, so a pointer key is identified by its hash alone
 void **map_put(Map *map, void *key, void *val) {
-    return map_put_hashed(map, key, val, ptr_hash(key));
+    return map_put_hashed(map, ptr_hash(key), val);
 }
 
 void *map_get(Map *map, void *key) {
-    return map_get_hashed(map, key, ptr_hash(key));
+    return map_get_hashed(map, ptr_hash(key));
 }
 
 typedef struct Intern {
-    struct Intern* next;
-    int len;
+    size_t len;
     char str[];
 }Intern;
 
+typedef struct StrRange {
+    const char *str;
+    size_t len;
+} StrRange;
+
 Arena str_arena;
 Map interns;
 
+static bool intern_match(const void *val, const void *ctx) {
+    const Intern *intern = val;
+    const StrRange *range = ctx;
+    return intern->len == range->len && memcmp(intern->str, range->str, range->len) == 0;
+}
+
 const char *str_intern_range(const char *start, const char *end) {
     size_t len = end - start;
     uint64_t hash = str_hash(start, len);
-    Intern *intern = map_get_hashed(&interns, (void *)hash, hash);
-    for (Intern *it = intern; it; it = it->next) {
-        if (it->len == len && strncmp(it->str, start, len) == 0) {
-            return it->str;
-        }
+    StrRange range = {start, len};
+    Intern **intern = (Intern **)map_find_hashed(&interns, hash, intern_match, &range);
+    if (intern) {
+        return (*intern)->str;
     }
     Intern *new_intern = arena_alloc(&str_arena, offsetof(Intern, str) + len + 1);
     new_intern->len = len;
-    new_intern->next = intern;
     memcpy(new_intern->str, start, len);
     new_intern->str[len] = 0;
-    map_put_hashed(&interns, (void *)hash, new_intern, hash);
+    map_insert_hashed(&interns, hash, new_intern);
     return new_intern->str;
 }
 
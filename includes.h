@@ -9,4 +9,16 @@
 #include <ctype.h>
 #include <stddef.h>
 #include <stdarg.h>
-#include <math.h>
\ No newline at end of file
+#include <math.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
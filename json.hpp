@@ -2,23 +2,32 @@
 #define K1804_JSON_CPP_H
 
 #include "JSON.h"
-#include "typeindex"
-#include "map"
+#include "type_traits"
+#include "cstddef"
+#include "cstring"
+#include "iterator"
+#include "string"
 #include "iostream"
+#if __cplusplus >= 201703L
+#include "string_view"
+#endif
+#if __cplusplus >= 202002L
+#include "span"
+#endif
 
-class JsonError : public std::exception{
+class JsonException : public std::exception{
 public:
     virtual const char* what() const throw() = 0;
 };
 
-class JsonUnknownKeyError : public JsonError{
+class JsonUnknownKeyError : public JsonException{
 public:
     virtual const char* what() const throw(){
         return "UnknownKey";
     }
 };
 
-class JsonTypeMismatchError : public JsonError{
+class JsonTypeMismatchError : public JsonException{
 public:
     virtual const char* what() const throw(){
         return "TypeMismatch";
@@ -37,20 +46,117 @@ void* operator new[] (size_t size,int id){
 
 namespace JSON{
 
+    //the exception base was called JsonError before the C parser's error struct took that name
+    using JsonError = JsonException;
+
     class Object;
-    class ObjectIterator;
-
-    static std::map<std::type_index,JsonType> json_type_map = {
-            {std::type_index(typeid(int)),JSON_number_int},
-            {std::type_index(typeid(double)),JSON_number_float},
-            {std::type_index(typeid(char*)),JSON_string},
-            {std::type_index(typeid(const char*)),JSON_string},
-            {std::type_index(typeid(JsonString)),JSON_string},
-            {std::type_index(typeid(bool)),JSON_bool},
-            {std::type_index(typeid(nullptr)),JSON_null},
-            {std::type_index(typeid(JsonArray)),JSON_array},
-            {std::type_index(typeid(JsonObject*)),JSON_object},
+
+    //JsonType of a C++ type, resolved at compile time
+    template<typename T>
+    struct json_type_of{
+        static constexpr bool supported = false;
+    };
+
+#define json_type_trait(cpp_type,json_type)\
+    template<>\
+    struct json_type_of<cpp_type>{\
+        static constexpr bool supported = true;\
+        static constexpr JsonType value = json_type;\
+    }
+
+    json_type_trait(int,JSON_number_int);
+    json_type_trait(double,JSON_number_float);
+    json_type_trait(char*,JSON_string);
+    json_type_trait(const char*,JSON_string);
+    json_type_trait(JsonString,JSON_string);
+    json_type_trait(bool,JSON_bool);
+    json_type_trait(std::nullptr_t,JSON_null);
+    json_type_trait(JsonArray,JSON_array);
+    json_type_trait(JsonObject*,JSON_object);
+#undef json_type_trait
+
+    //Typed read of a JsonValue: a tag compare and a load
+    template<typename T>
+    struct value_traits;
+
+#ifdef JSON_GENERATE_EXCEPTIONS
+#define json_value_read(expr,json_type,...)\
+        if (value) {      \
+            if (value->type == json_type){ \
+                return expr;\
+            }                             \
+            throw JsonTypeMismatchError();\
+        }\
+        throw JsonUnknownKeyError();\
+        return __VA_ARGS__
+#else
+#define json_value_read(expr,json_type,...)\
+        return value && value->type == json_type ? expr : __VA_ARGS__
+#endif
+
+#define json_value_trait(cpp_type,expr,json_type,...)\
+    template<>\
+    struct value_traits<cpp_type>{\
+        static inline cpp_type get(const JsonValue* value){\
+            json_value_read(expr,json_type,__VA_ARGS__);\
+        }\
+    }
+
+    //Numbers parsed lazily keep their text and are converted on read
+#define json_number_trait(cpp_type,token,json_type,convert)\
+    template<>\
+    struct value_traits<cpp_type>{\
+        static inline cpp_type get(const JsonValue* value){\
+            if (value && value->type == JSON_number_raw){\
+                return convert(value);\
+            }\
+            json_value_read(value->token,json_type,0);\
+        }\
+    }
+
+    json_number_trait(int,int_number,JSON_number_int,json_number_as_int);
+    json_number_trait(double,float_number,JSON_number_float,json_number_as_double);
+#undef json_number_trait
+
+#if __cplusplus >= 202002L
+    //Packed numeric arrays, see json_set_packed_arrays
+#define json_packed_trait(cpp_type,member,json_type)\
+    template<>\
+    struct value_traits<std::span<const cpp_type>>{\
+        static inline JsonArray packed(const JsonValue* value){\
+            JsonArray array;\
+            array.member = value->member;\
+            array.len = value->len;\
+            return array;\
+        }\
+        static inline JsonArray read(const JsonValue* value){\
+            json_value_read(packed(value),json_type,(JsonArray){nullptr,0});\
+        }\
+        static inline std::span<const cpp_type> get(const JsonValue* value){\
+            JsonArray packed = read(value);\
+            return std::span<const cpp_type>(packed.member,packed.len);\
+        }\
+    }
+
+    json_packed_trait(double,floats,JSON_array_float);
+    json_packed_trait(int64_t,ints,JSON_array_int);
+#undef json_packed_trait
+#endif
+    json_value_trait(char*,json_get_string(value).str,JSON_string,nullptr);
+    json_value_trait(JsonString,json_get_string(value),JSON_string,(JsonString){nullptr,0});
+    json_value_trait(bool,value->boolean,JSON_bool,0);
+    json_value_trait(JsonObject*,value->object,JSON_object,nullptr);
+#undef json_value_trait
+
+    //Packed arrays have no elements to view or edit here: read them as std::span
+    template<>
+    struct value_traits<JsonArray>{
+        static inline JsonArray get(const JsonValue* value){
+            assert(!value || (value->type != JSON_array_float && value->type != JSON_array_int));
+            json_value_read(json_get_array(value),JSON_array,(JsonArray){nullptr,0});
+        }
     };
+#undef json_value_read
 
     class Value{
         JsonValue* value;
@@ -62,20 +168,25 @@ namespace JSON{
             dst->float_number = value;
         }
         static void set(JsonValue* dst,char* value){
-            dst->string = json_string(value);
+            json_value_set_string(dst,json_string(value));
+        }
+        static void set(JsonValue* dst,const char* value){
+            json_value_set_string(dst,json_string(value));
         }
         static void set(JsonValue* dst,JsonString value){
-            dst->string = value;
+            json_value_set_string(dst,value);
         }
         static void set(JsonValue* dst,bool value){
             dst->boolean = value;
         }
         static void set(JsonValue* dst,JsonArray value){
-            dst->array = value;
+            dst->values = value.values;
+            dst->len = (uint32_t)value.len;
         }
         static void set(JsonValue* dst,JsonObject* value){
             dst->object = value;
         }
+        static void set(JsonValue*,std::nullptr_t){}
         Value(JsonValue* val){
             this->value = val;
         }
@@ -106,58 +217,117 @@ namespace JSON{
         Value(JsonObject* value){
             this->value =  json_value_object(value);
         }
+        Value(std::nullptr_t){
+            this->value = json_value_null();
+        }
         void operator=(JsonValue* value){
             this->value = value;
         }
 
-#ifdef JSON_GENERATE_EXCEPTIONS
-#define operator_type(token,json_type,...)\
-        if (this->value) {      \
-            if (this->value->type == json_type){ \
-                return this->value->token;\
-            }                             \
-            throw JsonTypeMismatchError();\
-        }\
-        throw JsonUnknownKeyError();\
-        return __VA_ARGS__
-#else
-#define operator_type(token,...)\
-        return this->value ? this->value->token : __VA_ARGS__
-#endif
-
         operator int() const{
-            operator_type(int_number,JSON_number_int,0);
+            return value_traits<int>::get(this->value);
         }
         operator double () const{
-            operator_type(float_number,JSON_number_float,0);
+            return value_traits<double>::get(this->value);
         }
         operator char*() const{
-            operator_type(string.str,JSON_string,nullptr);
+            return value_traits<char*>::get(this->value);
         }
         operator std::string() const{
-            operator_type(string.str,JSON_string, nullptr);
+            JsonString str = *this;
+            return str.str ? std::string(str.str,str.len) : std::string();
+        }
+#if __cplusplus >= 201703L
+        //zero-copy view into the document's storage
+        operator std::string_view() const{
+            JsonString str = *this;
+            return std::string_view(str.str,str.len);
         }
+        inline std::string_view view() const{
+            return *this;
+        }
+#endif
         operator JsonString () const{
-            operator_type(string,JSON_string, (JsonString){nullptr,0});
+            return value_traits<JsonString>::get(this->value);
         }
         operator bool() const{
-            operator_type(boolean,JSON_bool,0);
+            return value_traits<bool>::get(this->value);
         }
         operator JsonObject*() const{
-            operator_type(object,JSON_object, nullptr);
+            return value_traits<JsonObject*>::get(this->value);
         }
         operator JsonArray() const{
-            operator_type(array,JSON_array, (JsonArray){nullptr,0});
+            return value_traits<JsonArray>::get(this->value);
         }
-#undef operator_type
+#if __cplusplus >= 202002L
+        //zero-copy view of a packed array, empty for any other value
+        operator std::span<const double>() const{
+            return value_traits<std::span<const double>>::get(this->value);
+        }
+        operator std::span<const int64_t>() const{
+            return value_traits<std::span<const int64_t>>::get(this->value);
+        }
+#endif
         inline JsonValue* operator*(){return this->value;}
         inline operator JsonValue*(){return this->value;}
     };
 
+    template<>
+    struct value_traits<Value>{
+        static inline Value get(const JsonValue* value){
+            return Value(const_cast<JsonValue*>(value));
+        }
+    };
+
+    //Random access over a contiguous array of element pointers, projecting
+    //each element with Project::get (value_traits<T> for arrays)
+    template<typename Element,typename T,typename Project>
+    class PointerIterator{
+        Element* it;
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using iterator_concept = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using reference = T;
+        using pointer = void;
+
+        PointerIterator(){
+            it = nullptr;
+        }
+        explicit PointerIterator(Element* it){
+            this->it = it;
+        }
+        inline Element* base() const{return it;}
+
+        inline T operator*() const{return Project::get(*it);}
+        inline T operator[](difference_type n) const{return Project::get(it[n]);}
+
+        inline PointerIterator& operator++(){it++; return *this;}
+        inline PointerIterator operator++(int){PointerIterator prev = *this; it++; return prev;}
+        inline PointerIterator& operator--(){it--; return *this;}
+        inline PointerIterator operator--(int){PointerIterator prev = *this; it--; return prev;}
+        inline PointerIterator& operator+=(difference_type n){it += n; return *this;}
+        inline PointerIterator& operator-=(difference_type n){it -= n; return *this;}
+        inline PointerIterator operator+(difference_type n) const{return PointerIterator(it + n);}
+        inline PointerIterator operator-(difference_type n) const{return PointerIterator(it - n);}
+        friend inline PointerIterator operator+(difference_type n,const PointerIterator& other){return other + n;}
+        inline difference_type operator-(const PointerIterator& other) const{return it - other.it;}
+
+        inline bool operator==(const PointerIterator& other) const{return it == other.it;}
+        inline bool operator!=(const PointerIterator& other) const{return it != other.it;}
+        inline bool operator<(const PointerIterator& other) const{return it < other.it;}
+        inline bool operator>(const PointerIterator& other) const{return it > other.it;}
+        inline bool operator<=(const PointerIterator& other) const{return it <= other.it;}
+        inline bool operator>=(const PointerIterator& other) const{return it >= other.it;}
+    };
+
     template<typename T>
     class Array{
         JsonArray array;
     public:
+        using iterator = PointerIterator<JsonValue*,T,value_traits<T>>;
+
         Array(JsonArray array){
             this->array = array;
         }
@@ -166,76 +336,175 @@ namespace JSON{
         }
         Array(std::initializer_list<T> list){
             array = {nullptr,0};
+            json_array_reserve(&array,list.size());
             for (auto val:list){
                 json_array_push(&array,Value(val));
             }
         }
-        inline Value begin(){
-            return Value(*this->array.values);
+        inline iterator begin() const{
+            return iterator(this->array.values);
         }
-        inline Value end(){
-            return Value(*(this->array.values + this->array.len));
+        inline iterator end() const{
+            return iterator(this->array.values + this->array.len);
         }
-        T operator[](size_t i){
-            return Value(array.values[i]);
+        inline T operator[](size_t i) const{
+            return value_traits<T>::get(array.values[i]);
         }
-        inline size_t length(){
+        inline size_t length() const{
+            return array.len;
+        }
+        inline size_t size() const{
             return array.len;
         }
         inline void push(T value){
             json_array_push(&this->array,Value(value));
         }
+        inline void insert(size_t i,T value){
+            json_array_insert(&this->array,i,Value(value));
+        }
+        inline void erase(size_t i){
+            json_array_erase(&this->array,i);
+        }
         operator JsonArray(){return this->array;}
     };
 
     class Field{
-        friend class ObjectIterator;
         friend class Object;
+        friend class ObjectIterator;
+        friend class Document;
     private:
-        JsonField* field;
-        Field(JsonField* value){
-            this->field = value;
+        JsonString name;
+        JsonValue** slot;   //the value pointer, in a JsonField or in a shaped object's values
+        JsonObject* owner;  //set instead of slot for a missing key: assigning appends the field
+        Arena* arena;       //where assigning allocates, the current json arena when null
+        Field(JsonField* field){
+            this->name = field->key;
+            this->slot = &field->value;
+            this->owner = nullptr;
+            this->arena = nullptr;
+        }
+        Field(JsonString key,JsonValue** slot){
+            this->name = key;
+            this->slot = slot;
+            this->owner = nullptr;
+            this->arena = nullptr;
+        }
+        Field(JsonObject* owner,const char* key){
+            this->name = JsonString{const_cast<char*>(key),strlen(key)};
+            this->slot = nullptr;
+            this->owner = owner;
+            this->arena = nullptr;
+        }
+        template<typename T>
+        void assign(T value){
+            if (!slot){
+                JsonField* field = json_field(name.str,nullptr);
+                json_put_field(owner,field);
+                slot = &field->value;
+                owner = nullptr;
+            }
+            if (*slot){
+                if ((*slot)->type == json_type_of<T>::value){
+                    Value::set(*slot, value);
+                    return;
+                }
+            }
+            *slot = Value(value);
         }
     public:
         inline char* key(){
-            return field->key.str;
+            return name.str;
         }
         inline size_t key_length(){
-            return field->key.len;
+            return name.len;
         }
 
         template<typename T>
-        inline operator T(){return Value(this->field->value);}
+        inline operator T(){return Value(slot ? *slot : nullptr);}
 
         template<typename T>
         void operator=(T value){
-            if (this->field->value){
-                if (this->field->value->type == json_type_map[std::type_index(typeid(T))]){
-                    Value::set(field->value, value);
-                    return;
-                }
+            static_assert(json_type_of<T>::supported,"type has no JSON representation");
+            if (!arena){
+                assign(value);
+                return;
             }
-            field->value = Value(value);
+            Arena* prev = json_set_arena(arena);
+            assign(value);
+            json_set_arena(prev);
         }
 
     };
 
+    //Random access over the fields of an object in either layout
     class ObjectIterator{
-        friend Object;
-    private:
-        JsonField** it;
-        ObjectIterator(JsonField** it){
-            this->it = it;
-        }
+        JsonObject* object;
+        size_t i;
     public:
-        inline void operator++(){
-            it++;
+        using iterator_category = std::random_access_iterator_tag;
+        using iterator_concept = std::random_access_iterator_tag;
+        using value_type = Field;
+        using difference_type = std::ptrdiff_t;
+        using reference = Field;
+        using pointer = void;
+
+        ObjectIterator(){
+            object = nullptr;
+            i = 0;
+        }
+        ObjectIterator(JsonObject* object,size_t i){
+            this->object = object;
+            this->i = i;
+        }
+
+        inline Field operator*() const{
+            if (object->shape){
+                return Field(object->shape->keys[i],object->values + i);
+            }
+            return Field(object->fields[i]);
         }
-        inline bool operator!=(ObjectIterator& other){
-            return this->it != other.it;
+        inline Field operator[](difference_type n) const{return *(*this + n);}
+
+        inline ObjectIterator& operator++(){i++; return *this;}
+        inline ObjectIterator operator++(int){ObjectIterator prev = *this; i++; return prev;}
+        inline ObjectIterator& operator--(){i--; return *this;}
+        inline ObjectIterator operator--(int){ObjectIterator prev = *this; i--; return prev;}
+        inline ObjectIterator& operator+=(difference_type n){i += n; return *this;}
+        inline ObjectIterator& operator-=(difference_type n){i -= n; return *this;}
+        inline ObjectIterator operator+(difference_type n) const{return ObjectIterator(object,i + n);}
+        inline ObjectIterator operator-(difference_type n) const{return ObjectIterator(object,i - n);}
+        friend inline ObjectIterator operator+(difference_type n,const ObjectIterator& other){return other + n;}
+        inline difference_type operator-(const ObjectIterator& other) const{return (difference_type)(i - other.i);}
+
+        inline bool operator==(const ObjectIterator& other) const{return i == other.i;}
+        inline bool operator!=(const ObjectIterator& other) const{return i != other.i;}
+        inline bool operator<(const ObjectIterator& other) const{return i < other.i;}
+        inline bool operator>(const ObjectIterator& other) const{return i > other.i;}
+        inline bool operator<=(const ObjectIterator& other) const{return i <= other.i;}
+        inline bool operator>=(const ObjectIterator& other) const{return i >= other.i;}
+    };
+
+    //A key that caches the shape and slot it was last found at: looking it up
+    //again in an object of that shape is a pointer compare and an indexed load.
+    //Keep one per call site and thread, e.g. static thread_local Key key("id").
+    //The cache is dropped once json_free_shapes has run, as the shape may be reused.
+    class Key{
+        friend class Object;
+        const char* name;
+        size_t len;
+        const JsonShape* shape;
+        size_t slot;
+        uint64_t generation;
+    public:
+        explicit Key(const char* key){
+            name = key;
+            len = strlen(key);
+            shape = nullptr;
+            slot = 0;
+            generation = 0;
         }
-        inline Field operator*(){
-            return Field(*this->it);
+        inline const char* str() const{
+            return name;
         }
     };
 
@@ -246,6 +515,9 @@ namespace JSON{
     public:
         Object(std::initializer_list<JsonField*> list){
             JsonObject* obj = json_object(NULL,0);
+            if (list.size()){
+                json_object_reserve(obj,list.size());
+            }
             for (auto field:list){
                 json_put_field(obj,field);
             }
@@ -254,6 +526,9 @@ namespace JSON{
 
         Object(std::initializer_list<std::pair<const char*,JsonValue*>> list){
             JsonObject* obj = json_object(NULL,0);
+            if (list.size()){
+                json_object_reserve(obj,list.size());
+            }
             for (auto pair:list){
                 json_put_field(obj, json_field(pair.first,pair.second));
             }
@@ -280,44 +555,276 @@ namespace JSON{
         }
 
         Field operator[](const char* key){
+            if (this->object->shape){
+                JsonShape* shape = this->object->shape;
+                size_t slot = json_shape_slot(shape,key,strlen(key));
+                if (slot < shape->count){
+                    return Field(shape->keys[slot],this->object->values + slot);
+                }
+                return Field(this->object,key);
+            }
             JsonField* field = json_get_field(this->object,key);
-            if (!field){
-                field = json_field(key, nullptr);
-                json_put_field(this->object, field);
+            return field ? Field(field) : Field(this->object,key);
+        }
+
+        Field operator[](Key& key){
+            JsonShape* shape = this->object->shape;
+            if (shape && shape == key.shape && key.generation == json_shape_generation){
+                return Field(shape->keys[key.slot],this->object->values + key.slot);
             }
-            return Field(field);
+            if (shape){
+                size_t slot = json_shape_slot(shape,key.name,key.len);
+                if (slot < shape->count){
+                    key.shape = shape;
+                    key.slot = slot;
+                    key.generation = json_shape_generation;
+                    return Field(shape->keys[slot],this->object->values + slot);
+                }
+            }
+            return (*this)[key.name];
         }
 
         inline void operator=(JsonObject* right){
             this->object = right;
         }
 
+        inline bool remove(const char* key){
+            return json_remove_field(this->object,key);
+        }
+
         inline void format_print(bool format){
             this->object->format_print = format;
         }
 
-        inline ObjectIterator begin(){
-            return ObjectIterator(this->object->fields);
+        inline ObjectIterator begin() const{
+            return ObjectIterator(this->object,0);
         }
 
-        inline ObjectIterator end(){
-            return ObjectIterator(this->object->fields + this->object->fields_count);
+        inline ObjectIterator end() const{
+            return ObjectIterator(this->object,this->object->fields_count);
         }
 
-        inline size_t size(){
+        inline size_t size() const{
             return this->object->fields_count;
         }
 
         operator JsonObject* (){return this->object;}
     };
 
+    //Owns an arena with everything parsed or built into it. Object, Value and
+    //Array are non-owning views that stay valid until the Document is destroyed.
+    //Like the parser, Documents are used from one thread at a time.
+    class Document{
+        Arena arena;
+        JsonObject* root_object;
+        ::JsonError parse_error = {};
+
+        void release(){
+            if (root_object){
+                json_free_object(root_object);
+                root_object = nullptr;
+            }
+            json_free_arena(&arena);
+        }
+    public:
+        //Allocates everything created during its lifetime in the document
+        class Scope{
+            Arena* prev;
+        public:
+            explicit Scope(Document& doc){
+                prev = json_set_arena(&doc.arena);
+            }
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+            ~Scope(){
+                json_set_arena(prev);
+            }
+        };
+
+        Document(){
+            arena = {};
+            Scope scope(*this);
+            root_object = json_object(NULL,0);
+        }
+        explicit Document(const char* str){
+            arena = {};
+            Scope scope(*this);
+            root_object = json_parse_n(str,strlen(str),&parse_error);
+        }
+        Document(Document&& other) noexcept{
+            arena = other.arena;
+            root_object = other.root_object;
+            parse_error = other.parse_error;
+            other.arena = {};
+            other.root_object = nullptr;
+        }
+        Document& operator=(Document&& other) noexcept{
+            if (this != &other){
+                release();
+                arena = other.arena;
+                root_object = other.root_object;
+                parse_error = other.parse_error;
+                other.arena = {};
+                other.root_object = nullptr;
+            }
+            return *this;
+        }
+        Document(const Document&) = delete;
+        Document& operator=(const Document&) = delete;
+        ~Document(){
+            release();
+        }
+
+        inline Object root(){
+            return Object(root_object);
+        }
+        //Assigning to the field allocates in the document as well
+        inline Field operator[](const char* key){
+            Scope scope(*this);
+            Field field = root()[key];
+            field.arena = &arena;
+            return field;
+        }
+        inline explicit operator bool() const{
+            return root_object != nullptr;
+        }
+        //Why parsing failed, code is JSON_OK otherwise
+        inline const ::JsonError& error() const{
+            return parse_error;
+        }
+    };
+
     std::ostream& operator<<(std::ostream& os, const Object& object){
         char* buffer = json_stringify(object.object);
-        os << buffer;
-        free(buffer);
+        os.write(buffer,json_buffer_len(buffer));
+        json_buffer_free(buffer);
         return os;
     }
 
+    //Struct bindings: decode JSON straight into members, see JSON_BINDING
+
+    template<typename T>
+    struct Binding;
+
+    template<typename M>
+    struct bind_traits{
+        static JsonBindField field(const char* key,const char* quoted_key,size_t offset){
+            return {key,JSON_object,offset,Binding<M>::get(),nullptr,nullptr,quoted_key,0,0,0};
+        }
+    };
+
+#define json_bind_scalar(cpp_type,json_type)\
+    template<>\
+    struct bind_traits<cpp_type>{\
+        static JsonBindField field(const char* key,const char* quoted_key,size_t offset){\
+            return {key,json_type,offset,nullptr,nullptr,nullptr,quoted_key,0,0,0};\
+        }\
+    }
+
+    json_bind_scalar(int,JSON_number_int);
+    json_bind_scalar(double,JSON_number_float);
+    json_bind_scalar(bool,JSON_bool);
+    json_bind_scalar(JsonString,JSON_string);
+#undef json_bind_scalar
+
+    template<>
+    struct bind_traits<std::string>{
+        static void set(void* member,const char* str,size_t len){
+            static_cast<std::string*>(member)->assign(str,len);
+        }
+        static JsonString get(const void* member){
+            const std::string* str = static_cast<const std::string*>(member);
+            return {const_cast<char*>(str->data()),str->size()};
+        }
+        static JsonBindField field(const char* key,const char* quoted_key,size_t offset){
+            return {key,JSON_string,offset,nullptr,set,get,quoted_key,0,0,0};
+        }
+    };
+
+    inline JsonBinding make_binding(JsonBindField* fields,size_t count){
+        JsonBinding binding = {fields,count,false};
+        json_binding_init(&binding);
+        return binding;
+    }
+
+    template<typename T>
+    inline bool decode(const char* str,T& dst){
+        return json_decode(str,strlen(str),&dst,Binding<T>::get(),nullptr);
+    }
+
+    template<typename T>
+    inline bool decode(const char* str,T& dst,::JsonError& error){
+        return json_decode(str,strlen(str),&dst,Binding<T>::get(),&error);
+    }
+
+    //Reusable output buffer for JSON::encode
+    class Writer{
+        char* buffer;
+    public:
+        Writer(){
+            buffer = nullptr;
+        }
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+        ~Writer(){
+            json_buffer_free(buffer);
+        }
+        //nullptr when a double member is NaN or infinite
+        template<typename T>
+        const char* encode(const T& src){
+            json_buffer_clear(buffer);
+            buffer = json_encode(buffer,&src,Binding<T>::get());
+            return buffer;
+        }
+        inline const char* str() const{
+            return buffer;
+        }
+        inline size_t length() const{
+            return json_buffer_len(buffer);
+        }
+    };
+
 }
 
+#define json__cat_(a,b) a##b
+#define json__cat(a,b) json__cat_(a,b)
+#define json__count_n(_1,_2,_3,_4,_5,_6,_7,_8,_9,_10,_11,_12,_13,_14,_15,_16,n,...) n
+#define json__count(...) json__count_n(__VA_ARGS__,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1)
+#define json__map1(m,t,x) m(t,x)
+#define json__map2(m,t,x,...) m(t,x),json__map1(m,t,__VA_ARGS__)
+#define json__map3(m,t,x,...) m(t,x),json__map2(m,t,__VA_ARGS__)
+#define json__map4(m,t,x,...) m(t,x),json__map3(m,t,__VA_ARGS__)
+#define json__map5(m,t,x,...) m(t,x),json__map4(m,t,__VA_ARGS__)
+#define json__map6(m,t,x,...) m(t,x),json__map5(m,t,__VA_ARGS__)
+#define json__map7(m,t,x,...) m(t,x),json__map6(m,t,__VA_ARGS__)
+#define json__map8(m,t,x,...) m(t,x),json__map7(m,t,__VA_ARGS__)
+#define json__map9(m,t,x,...) m(t,x),json__map8(m,t,__VA_ARGS__)
+#define json__map10(m,t,x,...) m(t,x),json__map9(m,t,__VA_ARGS__)
+#define json__map11(m,t,x,...) m(t,x),json__map10(m,t,__VA_ARGS__)
+#define json__map12(m,t,x,...) m(t,x),json__map11(m,t,__VA_ARGS__)
+#define json__map13(m,t,x,...) m(t,x),json__map12(m,t,__VA_ARGS__)
+#define json__map14(m,t,x,...) m(t,x),json__map13(m,t,__VA_ARGS__)
+#define json__map15(m,t,x,...) m(t,x),json__map14(m,t,__VA_ARGS__)
+#define json__map16(m,t,x,...) m(t,x),json__map15(m,t,__VA_ARGS__)
+#define json__map(m,t,...) json__cat(json__map,json__count(__VA_ARGS__))(m,t,__VA_ARGS__)
+
+#define JSON_BIND_FIELD(type,member)\
+    JSON::bind_traits<decltype(type::member)>::field(#member,"\"" #member "\":",offsetof(type,member))
+
+//Declares the bound members of a struct (up to 16), at global scope:
+//  JSON_BINDING(Point, x, y)
+//  Point p; JSON::decode("{\"x\":1,\"y\":2}", p);
+//  JSON::Writer writer; writer.encode(p);
+#define JSON_BINDING(type,...)\
+    namespace JSON{\
+        template<>\
+        struct Binding<type>{\
+            static JsonBinding* get(){\
+                static JsonBindField fields[] = {json__map(JSON_BIND_FIELD,type,__VA_ARGS__)};\
+                static JsonBinding binding = make_binding(fields,sizeof(fields)/sizeof(*fields));\
+                return &binding;\
+            }\
+        };\
+    }
+
 #endif //K1804_JSON_CPP_H
@@ -1,20 +1,12 @@
-const char *false_keyword;
-const char *true_keyword;
-const char *null_keyword;
-
-const char *first_keyword;
-const char *last_keyword;
-const char **keywords;
-
-
-
 typedef enum TokenKind {
     TOKEN_EOF,
     TOKEN_INT = 128,
     TOKEN_FLOAT,
     TOKEN_STR,
-    TOKEN_NAME,
-    TOKEN_KEYWORD,
+    TOKEN_NAME,     //identifier other than a literal, never valid JSON
+    TOKEN_TRUE,
+    TOKEN_FALSE,
+    TOKEN_NULL,
     // ...
 } TokenKind;
 
@@ -32,40 +24,23 @@ typedef struct Token {
     const char *start;
     const char *end;
     union {
-        int32_t int_val;
+        int64_t int_val;
         const char* str_val;
         double float_val;
-        const char* name;
     };
 } Token;
 
 
 
-#define KEYWORD(name) name##_keyword = str_intern(#name); buf_push(keywords, name##_keyword)
-
-void init_keywords() {
-    static bool inited;
-    if (inited) {
-        return;
-    }
-    char *arena_end = str_arena.end;
-    KEYWORD(false);
-    KEYWORD(true);
-    KEYWORD(null);
-    first_keyword = false_keyword;
-    last_keyword = null_keyword;
-    inited = true;
-}
-
-#undef KEYWORD
-
-bool is_keyword_str(const char *str) {
-    return first_keyword <= str && str <= last_keyword;
-}
-
-
 Token token;
 const char *stream;
+const char *stream_start;
+const char *stream_end;     //the lexer never reads at or past it, a NUL before it also ends the input
+
+// Byte at p, or 0 at the end of the input
+#define stream_at(p) ((p) < stream_end ? (uint8_t)*(p) : 0)
+bool lex_validate;      //check strings and numbers without copying or converting them
+bool lex_raw_numbers;   //leave numbers unconverted, the parser keeps their text
 
 void fatal(const char* fmt,...){
     va_list args;
@@ -76,11 +51,51 @@ void fatal(const char* fmt,...){
     exit(1);
 }
 
+// Syntax errors unwind to the entry point that armed lex_error, which then
+// returns a failure. With nothing armed they are fatal.
+JsonError* lex_error;
+jmp_buf lex_error_jump;
+
+void syntax_error(const char* pos,JsonErrorCode code,const char* fmt,...){
+    va_list args;
+    va_start(args,fmt);
+    if (!lex_error){
+        printf("FATAL: ");
+        vprintf(fmt,args);
+        va_end(args);
+        exit(1);
+    }
+    lex_error->code = code;
+    lex_error->offset = pos - stream_start;
+    lex_error->line = 1;
+    const char* line_start = stream_start;
+    for (const char* it = stream_start; it != pos; it++){
+        if (*it == '\n'){
+            lex_error->line++;
+            line_start = it + 1;
+        }
+    }
+    lex_error->column = (int)(pos - line_start) + 1;
+    vsnprintf(lex_error->message,sizeof(lex_error->message),fmt,args);
+    va_end(args);
+    longjmp(lex_error_jump,1);
+}
+
 const char* token_kind_names[] = {
+        [TOKEN_EOF] = "end of file",
         [TOKEN_INT] = "number",
         [TOKEN_FLOAT] = "number",
-        [TOKEN_KEYWORD] = "keyword",
-        [TOKEN_NAME] = "name"
+        [TOKEN_STR] = "string",
+        [TOKEN_NAME] = "name",
+        [TOKEN_TRUE] = "true",
+        [TOKEN_FALSE] = "false",
+        [TOKEN_NULL] = "null",
+        ['{'] = "'{'",
+        ['}'] = "'}'",
+        ['['] = "'['",
+        [']'] = "']'",
+        [':'] = "':'",
+        [','] = "','",
 };
 
 const char* token_kind_name(TokenKind kind) {
@@ -91,6 +106,11 @@ const char* token_kind_name(TokenKind kind) {
     }
 }
 
+const char* token_desc(TokenKind kind){
+    const char* name = token_kind_name(kind);
+    return name ? name : "unexpected character";
+}
+
 uint8_t char_to_digit[256] = {
         ['0'] = 0,
         ['1'] = 1,
@@ -110,164 +130,347 @@ uint8_t char_to_digit[256] = {
         ['f'] = 15, ['F'] = 15,
 };
 
-void scan_int() {
-    uint64_t base = 10;
-    if (*stream == '0') {
-        stream++;
-        if (tolower(*stream) == 'x') {
-            stream++;
-            token.mod = TOKENMOD_HEX;
-            base = 16;
-        } else if (tolower(*stream) == 'b') {
-            stream++;
-            token.mod = TOKENMOD_BIN;
-            base = 2;
-        } else if (isdigit(*stream)) {
-            token.mod = TOKENMOD_OCT;
-            base = 8;
-        }
+// Converts token.start..end; the text is copied out first since the input
+// need not be terminated right after the number
+void scan_float(const char* end) {
+    char digits[64];
+    size_t len = end - token.start;
+    char* text = len < sizeof(digits) ? digits : xmalloc(len + 1);
+    memcpy(text, token.start, len);
+    text[len] = 0;
+    double val = strtod(text, NULL);
+    if (text != digits) {
+        free(text);
+    }
+    if (val == HUGE_VAL || val == -HUGE_VAL) {
+        syntax_error(token.start, JSON_ERROR_NUMBER, "Float literal out of range");
+    }
+    token.kind = TOKEN_FLOAT;
+    token.float_val = val;
+}
+
+// Converts the number token.start..end, already checked against the JSON
+// grammar. Integers outside int64_t range become floats.
+void scan_int(const char* end) {
+    const char* it = token.start;
+    bool negative = *it == '-';
+    if (negative) {
+        it++;
     }
     uint64_t val = 0;
-    for (;;) {
-        uint64_t digit = char_to_digit[*stream];
-        if (digit == 0 && *stream != '0') {
-            break;
-        }
-        if (digit >= base) {
-            fatal("Digit '%c' out of range for base %", *stream, base);
-            digit = 0;
-        }
-        if (val > (UINT64_MAX - digit)/base) {
-            fatal("Integer literal overflow");
-            while (isdigit(*stream)) {
-                stream++;
-            }
-            val = 0;
-            break;
+    for (; it != end; it++) {
+        uint64_t digit = char_to_digit[(uint8_t)*it];
+        if (val > ((uint64_t)INT64_MAX + negative - digit)/10) {
+            scan_float(end);
+            return;
         }
-        val = val*base + digit;
-        stream++;
+        val = val*10 + digit;
     }
     token.kind = TOKEN_INT;
-    token.int_val = val;
+    token.int_val = negative ? (int64_t)(0 - val) : (int64_t)val;
 }
 
-void scan_float() {
-    const char *start = stream;
-    while (isdigit(*stream)) {
+// -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+void scan_number() {
+    token.start = stream;
+    bool is_float = false;
+    bool has_exponent = false;
+    if (stream_at(stream) == '-') {
         stream++;
     }
-    if (*stream == '.') {
+    if (stream_at(stream) == '0') {
         stream++;
+    } else if (isdigit(stream_at(stream))) {
+        while (isdigit(stream_at(stream))) {
+            stream++;
+        }
+    } else {
+        syntax_error(stream, JSON_ERROR_NUMBER, "Expected digit in number");
     }
-    while (isdigit(*stream)) {
+    if (stream_at(stream) == '.') {
         stream++;
+        if (!isdigit(stream_at(stream))) {
+            syntax_error(stream, JSON_ERROR_NUMBER, "Expected digit after decimal point");
+        }
+        while (isdigit(stream_at(stream))) {
+            stream++;
+        }
+        is_float = true;
     }
-    if (tolower(*stream) == 'e') {
+    if (stream_at(stream) == 'e' || stream_at(stream) == 'E') {
         stream++;
-        if (*stream == '+' || *stream == '-') {
+        if (stream_at(stream) == '+' || stream_at(stream) == '-') {
             stream++;
         }
-        if (!isdigit(*stream)) {
-            fatal("Expected digit after float literal exponent, found '%c'.", *stream);
+        if (!isdigit(stream_at(stream))) {
+            syntax_error(stream, JSON_ERROR_NUMBER, "Expected digit in exponent");
         }
-        while (isdigit(*stream)) {
+        while (isdigit(stream_at(stream))) {
             stream++;
         }
+        is_float = true;
+        has_exponent = true;
     }
-    double val = strtod(start, NULL);
-    if (val == HUGE_VAL || val == -HUGE_VAL) {
-        fatal("Expected digit after float literal exponent, found '%c'.", *stream);
+    if (isalnum(stream_at(stream))) {
+        syntax_error(stream, JSON_ERROR_NUMBER, "Unexpected '%c' in number", *stream);
+    }
+    if (lex_validate && (has_exponent || stream - token.start > 300)) {
+        //only these can overflow a double: range check them as the parser would
+        scan_float(stream);
+    } else if (lex_validate || lex_raw_numbers) {
+        token.kind = is_float ? TOKEN_FLOAT : TOKEN_INT;
+    } else if (is_float) {
+        scan_float(stream);
+    } else {
+        scan_int(stream);
     }
-    token.kind = TOKEN_FLOAT;
-    token.float_val = val;
 }
 
 char escape_to_char[256] = {
         ['n'] = '\n',
         ['r'] = '\r',
         ['t'] = '\t',
-        ['v'] = '\v',
         ['b'] = '\b',
-        ['a'] = '\a',
-        ['0'] = 0,
+        ['f'] = '\f',
+        ['"'] = '"',
+        ['\\'] = '\\',
+        ['/'] = '/',
 };
 
+// Bytes that end a run of plain string characters: the closing quote,
+// escapes, control characters and the lead byte of a multi-byte sequence
+#define is_str_run_stop(c) ((uint8_t)(c) < 0x20 || (uint8_t)(c) >= 0x80 || (c) == '"' || (c) == '\\')
+
+// Returns the end of the valid UTF-8 sequence at p, or NULL. The second byte
+// range excludes overlong forms, surrogates and code points above U+10FFFF
+const char* scan_utf8(const char* p){
+    uint8_t c = stream_at(p);
+    int len = 0;
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF){
+        len = 2;
+    }else if (c >= 0xE0 && c <= 0xEF){
+        len = 3;
+        if (c == 0xE0){
+            lo = 0xA0;
+        }else if (c == 0xED){
+            hi = 0x9F;
+        }
+    }else if (c >= 0xF0 && c <= 0xF4){
+        len = 4;
+        if (c == 0xF0){
+            lo = 0x90;
+        }else if (c == 0xF4){
+            hi = 0x8F;
+        }
+    }else{
+        return NULL;
+    }
+    if (stream_end - p < len){
+        return NULL;
+    }
+    c = p[1];
+    if (c < lo || c > hi){
+        return NULL;
+    }
+    for (int i = 2; i < len; i++){
+        c = p[i];
+        if (c < 0x80 || c > 0xBF){
+            return NULL;
+        }
+    }
+    return p + len;
+}
+
+// Skips plain string characters, 16 bytes per step with SSE2 while a whole
+// step fits before stream_end, then byte by byte. Returns stream_end when the
+// input ends inside the run.
+const char* scan_str_run(const char* p){
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    while (stream_end - p >= 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        //signed compare: both control characters and bytes >= 0x80 are below 0x20
+        __m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk,quote),_mm_cmpeq_epi8(chunk,backslash)),
+                                    _mm_cmplt_epi8(chunk,space));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(stop);
+        if (mask){
+            return p + map_first_bit(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < stream_end && !is_str_run_stop(*p)){
+        p++;
+    }
+    return p;
+}
+
+uint32_t scan_hex4(){
+    uint32_t val = 0;
+    for (int i = 0; i < 4; i++){
+        if (!isxdigit(stream_at(stream))){
+            syntax_error(stream,JSON_ERROR_STRING,"Invalid \\u escape in string literal");
+        }
+        val = val*16 + char_to_digit[(uint8_t)*stream];
+        stream++;
+    }
+    return val;
+}
+
+char* buf_push_utf8(char* buf, uint32_t c){
+    if (c < 0x80){
+        buf_push(buf,(char)c);
+    }else if (c < 0x800){
+        buf_push(buf,(char)(0xC0 | (c >> 6)));
+        buf_push(buf,(char)(0x80 | (c & 0x3F)));
+    }else if (c < 0x10000){
+        buf_push(buf,(char)(0xE0 | (c >> 12)));
+        buf_push(buf,(char)(0x80 | ((c >> 6) & 0x3F)));
+        buf_push(buf,(char)(0x80 | (c & 0x3F)));
+    }else{
+        buf_push(buf,(char)(0xF0 | (c >> 18)));
+        buf_push(buf,(char)(0x80 | ((c >> 12) & 0x3F)));
+        buf_push(buf,(char)(0x80 | ((c >> 6) & 0x3F)));
+        buf_push(buf,(char)(0x80 | (c & 0x3F)));
+    }
+    return buf;
+}
+
+char* scan_escape(char* str){
+    assert(*stream == '\\');
+    stream++;
+    if (stream_at(stream) == 'u'){
+        stream++;
+        uint32_t c = scan_hex4();
+        if (c >= 0xD800 && c <= 0xDBFF){
+            if (stream_at(stream) != '\\' || stream_at(stream + 1) != 'u'){
+                syntax_error(stream,JSON_ERROR_STRING,"Unpaired surrogate in string literal");
+            }
+            stream += 2;
+            uint32_t low = scan_hex4();
+            if (low < 0xDC00 || low > 0xDFFF){
+                syntax_error(stream - 6,JSON_ERROR_STRING,"Unpaired surrogate in string literal");
+            }
+            c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        }else if (c >= 0xDC00 && c <= 0xDFFF){
+            syntax_error(stream - 6,JSON_ERROR_STRING,"Unpaired surrogate in string literal");
+        }
+        return buf_push_utf8(str,c);
+    }
+    char val = escape_to_char[stream_at(stream)];
+    if (val == 0){
+        if (stream == stream_end){
+            syntax_error(stream,JSON_ERROR_UNEXPECTED_EOF,"Unexpected end of file within string literal");
+        }
+        syntax_error(stream - 1,JSON_ERROR_STRING,"Invalid string literal escape '\\%c'",*stream);
+    }
+    buf_push(str,val);
+    stream++;
+    return str;
+}
+
+char* str_buf;  //scratch for the current string token, reused by every scan_str
+
+// Kept in str_buf rather than a local, so a syntax error never leaves it dangling
 void scan_str(){
     assert(*stream == '"');
+    token.start = stream;
     stream++;
-    char* str = NULL;
-    while(*stream && *stream !='"'){
-        char val = *stream;
-        if (val == '\n'){
-            fatal("String literal cannot contain newline");
-        }else if (val == '\\'){
+    buf_clear(str_buf);
+    for (;;){
+        const char* run = stream;
+        stream = scan_str_run(stream);
+        if (!lex_validate){
+            buf_write(str_buf,run,stream - run);
+        }
+        uint8_t c = stream_at(stream);
+        if (c == '"'){
             stream++;
-            val = escape_to_char[*stream];
-            if (val == 0 && *stream != '0'){
-                fatal("Invalid string literal escape '\\%c'",*stream);
+            break;
+        }else if (c == '\\'){
+            str_buf = scan_escape(str_buf);
+        }else if (c == 0){
+            syntax_error(stream,JSON_ERROR_UNEXPECTED_EOF,"Unexpected end of file within string literal");
+        }else if (c < 0x20){
+            syntax_error(stream,JSON_ERROR_STRING,"String literal cannot contain control character 0x%02x",c);
+        }else{
+            const char* end = scan_utf8(stream);
+            if (!end){
+                syntax_error(stream,JSON_ERROR_UTF8,"Invalid UTF-8 in string literal");
             }
+            if (!lex_validate){
+                buf_write(str_buf,stream,end - stream);
+            }
+            stream = end;
         }
-        buf_push(str,val);
-        stream++;
     }
-    if (*stream){
-        assert(*stream == '"');
+    buf_push(str_buf,0);
+    token.kind = TOKEN_STR;
+    token.str_val = str_buf;
+}
+
+void scan_name() {
+    token.start = stream;
+    while (isalnum(stream_at(stream)) || stream_at(stream) == '_') {
         stream++;
-    }else{
-        fatal("Unexpected end of file within string literal");
     }
-    buf_push(str,0);
-    token.kind = TOKEN_STR;
-    token.str_val = str;
+    token.kind = TOKEN_NAME;
+}
+
+// Matches true/false/null in place, comparing the remaining bytes after the
+// first-character dispatch in next_token
+bool scan_literal(const char* literal,size_t len,TokenKind kind) {
+    for (size_t i = 1; i < len; i++) {
+        if (stream_at(stream + i) != literal[i]) {
+            return false;
+        }
+    }
+    if (isalnum(stream_at(stream + len)) || stream_at(stream + len) == '_') {
+        return false;
+    }
+    token.start = stream;
+    token.kind = kind;
+    stream += len;
+    return true;
 }
 
 void next_token() {
     begin:
-    switch (*stream) {
+    switch (stream_at(stream)) {
         case '-':
-        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9': {
-            bool negative;
-            if (*stream == '-'){
-                negative = true;
-                stream++;
+        case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+            scan_number();
+            break;
+        case 't':
+            if (!scan_literal("true",4,TOKEN_TRUE)) {
+                scan_name();
             }
-            else negative = false;
-
-            char* num_start = stream;
-            while (isdigit(*stream)) {
-                stream++;
+            break;
+        case 'f':
+            if (!scan_literal("false",5,TOKEN_FALSE)) {
+                scan_name();
             }
-            char c = *stream;
-            stream = num_start;
-            if (c == '.' || tolower(c) == 'e') {
-                scan_float();
-                token.float_val = negative ? (-token.float_val) : token.float_val;
-            } else {
-                scan_int();
-                token.int_val = negative ? (-token.int_val) : token.int_val;
+            break;
+        case 'n':
+            if (!scan_literal("null",4,TOKEN_NULL)) {
+                scan_name();
             }
-
             break;
-        }
-        case 'a': case 'b': case 'c': case 'd':case 'e': case 'f':case 'g': case 'h':case 'i':case 'j':
-        case 'k': case 'l': case 'm': case 'n':case 'o': case 'p':case 'q': case 'r':case 's':case 't':
+        case 'a': case 'b': case 'c': case 'd':case 'e': case 'g': case 'h':case 'i':case 'j':
+        case 'k': case 'l': case 'm': case 'o': case 'p':case 'q': case 'r':case 's':
         case 'u': case 'v': case 'w': case 'x':case 'y': case 'z':
         case 'A': case 'B': case 'C': case 'D':case 'E': case 'F':case 'G': case 'H':case 'I':case 'J':
         case 'K': case 'L': case 'M': case 'N':case 'O': case 'P':case 'Q': case 'R': case 'S': case 'T':
         case 'U': case 'V': case 'W': case 'X':case 'Y': case 'Z':
-        case '_': {
-            token.start = stream;
-            while (isalnum(*stream) || *stream == '_') {
-                stream++;
-            }
-            token.kind = TOKEN_NAME;
-            token.name = str_intern_range(token.start,stream);
+        case '_':
+            scan_name();
             break;
-        }
-        case ' ':case '\r':case '\v':case '\b':case '\a':case '\n':case '\t':{
+        case ' ':case '\r':case '\n':case '\t':{
             stream++;
-            while (*stream == ' ' || *stream == '\n' || *stream == '\t') {
+            while (stream_at(stream) == ' ' || stream_at(stream) == '\n' || stream_at(stream) == '\t' || stream_at(stream) == '\r') {
                 stream++;
             }
             goto begin;
@@ -276,32 +479,42 @@ void next_token() {
             scan_str();
             break;
         case '\0':
+            token.start = stream;
             token.kind = TOKEN_EOF;
+            break;
         default:
+            token.start = stream;
             token.kind = *stream++;
     }
     token.end = stream;
 }
 
-void init_stream(const char *str) {
+void init_stream_n(const char *str, size_t len) {
     stream = str;
+    stream_start = str;
+    stream_end = str + len;
     next_token();
 }
 
+void init_stream(const char *str) {
+    init_stream_n(str, strlen(str));
+}
+
 void print_token(Token token) {
     switch (token.kind) {
         case TOKEN_INT:
-            printf("TOKEN NUMBER: %d ", token.int_val);
+            printf("TOKEN NUMBER: %lld ", (long long)token.int_val);
             break;
         case TOKEN_FLOAT:
             printf("TOKEN NUMBER: %f ", token.float_val);
             break;
         case TOKEN_NAME:
-            if (is_keyword_str(token.name)){
-                printf("TOKEN KEYWORD: %s ", token.name);
-            }else{
-                printf("TOKEN NAME: %s ", token.name);
-            }
+            printf("TOKEN NAME: %.*s ", (int)(token.end - token.start), token.start);
+            break;
+        case TOKEN_TRUE:
+        case TOKEN_FALSE:
+        case TOKEN_NULL:
+            printf("TOKEN KEYWORD: %s ", token_kind_name(token.kind));
             break;
         case TOKEN_STR:
             printf("TOKEN STR: \"%s\" ", token.str_val);
@@ -317,10 +530,6 @@ inline bool is_token(TokenKind kind){
     return token.kind == kind;
 }
 
-inline bool is_token_name(const char* name){
-    return token.kind = TOKEN_NAME && token.name == name;
-}
-
 inline bool match_token(TokenKind kind){
     if(is_token(kind)){
         next_token();
@@ -335,7 +544,8 @@ inline bool expect_token(TokenKind kind){
         next_token();
         return true;
     } else{
-        fatal("expected token %s, got %s",token_kind_name(token.kind)),token_kind_name(token.kind);
+        syntax_error(token.start,token.kind == TOKEN_EOF ? JSON_ERROR_UNEXPECTED_EOF : JSON_ERROR_UNEXPECTED_TOKEN,
+                     "Expected %s, got %s",token_desc(kind),token_desc(token.kind));
         return false;
     }
 }
@@ -1,10 +1,17 @@
 #include "includes.h"
 #include "common.h"
 #include "common.c"
+#include "JSON.h"
 #include "lex.c"
 #include "JSON.c"
+#include "JSON_shape.c"
 #include "JSON_parse.c"
 #include "JSON_print.c"
+#include "JSON_snapshot.c"
+#include "JSON_bind.c"
+#include "JSON_columns.c"
+#include "JSON_filter.c"
+#include "JSON_store.c"
 
 //void main_test(){
 //    //lex_test();
@@ -24,18 +24,887 @@ void json_print_test(){
                     json_field("Boolean", json_value_boolean(false))
             },3)))
     },6);
-    json_fprintf(stdout,obj,true);
+    json_fprintf_format(stdout,obj,&json_format_pretty);
 
-    json_get_field(obj,"String")->value->string = json_string("world");
+    json_value_set_string(json_get_field(obj,"String")->value,json_string("world"));
     json_get_field(json_get_field(obj,"Child-Object")->value->object,"Number")->value->float_number = 321;
     json_put_field(obj,json_field("Empty-Object",json_value_object(NULL)));
     json_put_field(obj,json_field("Empty-Array", json_value_array(NULL, 0)));
     printf("\n\n");
-    json_fprintf(stdout,obj,true);
+    JsonFormat format = {JSON_FORMAT_EXPANDED,1,'\t',true};
+    json_fprintf_format(stdout,obj,&format);
 
-    char* obj_str = json_stringify(obj,false);
+    char* obj_str = json_stringify(obj);
     printf("\n\n%s",obj_str);
     buf_free(obj_str);
 
     free_json_data();
-}
\ No newline at end of file
+}
+
+void json_edit_test(){
+    JsonObject* obj = json_parse("{\"a\":{\"x\":[1,2]},\"b\":[1,{\"y\":2}],\"a\":[3],\"c\":1}");
+    //replaced and removed values are freed: the leak checker sees their fields and elements go
+    json_set_field(obj,"c",json_value_object(NULL));
+    json_set_field(json_get_field(obj,"c")->value->object,"z",json_value_number_int(1));
+    assert(json_set_field(obj,"c",json_value_number_int(2))->value->int_number == 2);
+    assert(json_set_field(obj,"d",json_value_boolean(true)) == json_get_field(obj,"d"));
+    //duplicates: set changes the latest field, remove drops them all
+    json_set_field(obj,"a",json_value_number_int(4));
+    assert(obj->fields[0]->value->type == JSON_object && obj->fields[2]->value->int_number == 4);
+    assert(json_remove_field(obj,"a") && !json_remove_field(obj,"a") && !json_get_field(obj,"a"));
+    assert(obj->fields_count == 3 && !strcmp(obj->fields[0]->key.str,"b"));
+
+    JsonValue* b = json_get_field(obj,"b")->value;
+    json_value_array_insert(b,0,json_value_number_int(0));
+    json_value_array_insert(b,b->len,json_value_array(NULL,0));
+    json_value_array_push(b->values[b->len - 1],json_value_number_int(5));
+    json_value_array_erase(b,2);
+    json_value_array_erase(b,b->len - 1);
+    char* text = json_stringify(obj);
+    assert(!strcmp(text,"{\"b\":[0,1],\"c\":2,\"d\":true}"));
+    buf_free(text);
+    json_free_object(obj);
+    free_json_data();
+}
+
+void json_size_hint_test(){
+    JsonSizeHint hint = {0};
+    JsonObject* first = json_parse("{\"a\":1,\"b\":2,\"c\":3,\"items\":[1,2,3,4,5]}");
+    json_size_hint_update(&hint,json_value_object(first));
+    json_size_hint_update(&hint,json_get(first,"items"));
+    assert(hint.fields_count == 4 && hint.values_count == 5);
+    //the next document reserves what the first one needed
+    JsonObject* next = json_object_hinted(NULL,0,&hint);
+    JsonValue* items = json_value_array_hinted(NULL,0,&hint);
+    assert(buf_cap(next->fields) >= 4 && buf_cap(items->values) >= 5 && items->len == 0);
+    JsonField** fields = next->fields;
+    json_put_field(next,json_field("items",items));
+    for (int i = 0; i < 5; i++){
+        json_value_array_push(items,json_value_number_int(i));
+    }
+    json_put_field(next,json_field("a",json_value_number_int(1)));
+    assert(next->fields == fields && next->fields_count == 2 && items->len == 5);
+    json_free_object(first);
+    json_free_object(next);
+    free_json_data();
+}
+
+void json_hash_seed_test(){
+    //settable until the first hash, fixed afterwards so existing indexes stay valid
+    bool fresh = json_set_hash_seed(42);
+    uint64_t hash = json_key_hash("key",3);
+    assert(!json_set_hash_seed(7));
+    assert(json_key_hash("key",3) == hash && (!fresh || str_hash_get_seed() == 42));
+}
+
+void json_arena_test(){
+    enum {ITEMS = 200000};
+    BUF(char* text) = NULL;
+    buf_printf(text,"{\"items\":[");
+    for (int i = 0; i < ITEMS; i++){
+        buf_printf(text,"%s{\"name\":\"item number %d, too long to be inline\",\"n\":%d}",i ? "," : "",i,i);
+    }
+    buf_printf(text,"]}");
+
+    Arena arena = {0};
+    size_t blocks = 0;
+    for (int round = 0; round < 3; round++){
+        Arena* prev = json_set_arena(&arena);
+        JsonObject* doc = json_parse(text);
+        json_set_arena(prev);
+        JsonValue* items = json_get(doc,"items");
+        assert(items->len == ITEMS && json_get(items->values[ITEMS - 1]->object,"n")->int_number == ITEMS - 1);
+        //the first round grows the arena past ARENA_MMAP_THRESHOLD, later ones only reuse its blocks
+        assert(round ? buf_len(arena.blocks) == blocks : buf_len(arena.blocks) > 1);
+        blocks = buf_len(arena.blocks);
+#ifndef _WIN32
+        bool mapped = false;
+        for (ArenaBlock* block = arena.blocks; block != buf_end(arena.blocks); block++){
+            assert(block->mapped == (block->size >= ARENA_MMAP_THRESHOLD));
+            assert(!block->mapped || (uintptr_t)block->ptr % ARENA_HUGE_PAGE == 0);
+            mapped |= block->mapped;
+        }
+        assert(mapped);
+#endif
+        //objects own heap buffers the reset does not know about
+        json_free_object(doc);
+        json_reset_arena(&arena);
+        assert(arena.used == 1 && arena.ptr == arena.blocks[0].ptr);
+    }
+    json_free_arena(&arena);
+
+    //reserving a large block takes it whole, mapped where mmap is available
+    arena_reserve(&arena,ARENA_MMAP_THRESHOLD + 1);
+    assert(buf_len(arena.blocks) == 1 && arena.blocks[0].size > ARENA_MMAP_THRESHOLD);
+    assert(arena_alloc(&arena,ARENA_MMAP_THRESHOLD) == arena.blocks[0].ptr);
+    json_free_arena(&arena);
+    buf_free(text);
+}
+
+typedef struct BindInner{
+    bool on;
+}BindInner;
+
+typedef struct BindPoint{
+    int x;
+    double y;
+    JsonString label;
+    BindInner inner;
+}BindPoint;
+
+static JsonBindField bind_inner_fields[] = {
+    {"on",JSON_bool,offsetof(BindInner,on)},
+};
+static JsonBinding bind_inner = {bind_inner_fields,1};
+
+static JsonBindField bind_point_fields[] = {
+    {"x",JSON_number_int,offsetof(BindPoint,x)},
+    {"y",JSON_number_float,offsetof(BindPoint,y)},
+    {"la\"bel",JSON_string,offsetof(BindPoint,label)},
+    {"inner",JSON_object,offsetof(BindPoint,inner),&bind_inner},
+};
+static JsonBinding bind_point = {bind_point_fields,4};
+
+static bool bind_decode(const char* text,BindPoint* point,JsonError* error){
+    return json_decode(text,strlen(text),point,&bind_point,error);
+}
+
+void json_bind_test(){
+    BindPoint point = {0};
+    JsonError error;
+    assert(bind_decode("{\"x\":-7,\"y\":2,\"skip\":[{}],\"la\\\"bel\":\"hi\",\"inner\":{\"on\":true}}",&point,&error));
+    assert(error.code == JSON_OK && point.x == -7 && point.y == 2 && point.inner.on);
+    assert(point.label.len == 2 && !strcmp(point.label.str,"hi"));
+
+    //ints beyond int range are refused, not truncated
+    assert(!bind_decode("{\"x\":99999999999}",&point,&error) && error.code == JSON_ERROR_TYPE);
+    assert(!bind_decode("{\"x\":-2147483649}",&point,&error) && error.code == JSON_ERROR_TYPE);
+    assert(bind_decode("{\"x\":-2147483648}",&point,&error) && point.x == INT_MIN);
+    assert(!bind_decode("{\"x\":1.5}",&point,&error) && error.code == JSON_ERROR_TYPE && error.offset == 5);
+    //the root must be one object and nothing may follow it
+    assert(!bind_decode("[1]",&point,&error) && error.code == JSON_ERROR_UNEXPECTED_TOKEN);
+    assert(!bind_decode("",&point,&error) && error.code == JSON_ERROR_UNEXPECTED_EOF);
+    assert(!bind_decode("{\"x\":1} garbage",&point,&error) && error.code == JSON_ERROR_TRAILING);
+
+    //generated keys are escaped and outlive free_json_data
+    free_json_data();
+    point = (BindPoint){3,0.1,json_string("a\"b"),{false}};
+    BUF(char* text) = json_encode(NULL,&point,&bind_point);
+    assert(!strcmp(text,"{\"x\":3,\"y\":0.1,\"la\\\"bel\":\"a\\\"b\",\"inner\":{\"on\":false}}"));
+    BindPoint copy = {0};
+    assert(bind_decode(text,&copy,NULL) && copy.x == 3 && copy.y == 0.1 && !strcmp(copy.label.str,"a\"b"));
+    point.y = NAN;
+    assert(!json_encode(text,&point,&bind_point));
+    free_json_data();
+}
+
+void json_validate_test(){
+    //validation accepts exactly what the parser accepts, and fails the same way
+    static const struct{
+        const char* text;
+        JsonErrorCode code;
+        size_t offset;
+    }cases[] = {
+        {"{\"a\":[1,{\"b\":null}],\"c\":\"\\u00e9\"}",JSON_OK,0},
+        {"{\"a\":1e300,\"b\":-0.5e-400}",JSON_OK,0},
+        {"[1,2]",JSON_ERROR_UNEXPECTED_TOKEN,0},
+        {"1",JSON_ERROR_UNEXPECTED_TOKEN,0},
+        {"  ",JSON_ERROR_UNEXPECTED_EOF,2},
+        {"{\"a\":1e400}",JSON_ERROR_NUMBER,5},
+        {"{\"a\":-1e400}",JSON_ERROR_NUMBER,5},
+        {"{\"a\":1,}",JSON_ERROR_UNEXPECTED_TOKEN,7},
+        {"{\"a\":01}",JSON_ERROR_NUMBER,6},
+        {"{\"a\":[1,2}",JSON_ERROR_UNEXPECTED_TOKEN,9},
+        {"{\"a\":\"x",JSON_ERROR_UNEXPECTED_EOF,7},
+        {"{\"a\":tru}",JSON_ERROR_UNEXPECTED_TOKEN,5},
+        {"{\"a\":1}}",JSON_ERROR_TRAILING,7},
+        {"{\"a\":\n\"\\x\"}",JSON_ERROR_STRING,7},
+    };
+    for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++){
+        const char* text = cases[i].text;
+        JsonError parsed, validated;
+        JsonObject* obj = json_parse_n(text,strlen(text),&parsed);
+        bool valid = json_validate(text,strlen(text),&validated);
+        assert((obj != NULL) == valid && valid == (cases[i].code == JSON_OK));
+        assert(parsed.code == cases[i].code && validated.code == cases[i].code);
+        assert(parsed.offset == cases[i].offset && validated.offset == cases[i].offset);
+        if (obj){
+            json_free_object(obj);
+        }
+    }
+    JsonError error;
+    assert(!json_parse_n("{\"a\":\n  x}",10,&error) && error.line == 2 && error.column == 3);
+
+    //the depth limit applies to both
+    char deep[64] = "{\"a\":";
+    memset(deep + 5,'[',10);
+    memset(deep + 15,']',10);
+    strcpy(deep + 25,"}");
+    json_set_max_depth(10);
+    assert(!json_parse_n(deep,strlen(deep),&error) && error.code == JSON_ERROR_DEPTH);
+    assert(!json_validate(deep,strlen(deep),&error) && error.code == JSON_ERROR_DEPTH);
+    json_set_max_depth(11);
+    assert(json_validate(deep,strlen(deep),NULL));
+    json_free_object(json_parse_n(deep,strlen(deep),NULL));
+    json_set_max_depth(0);
+    free_json_data();
+}
+
+void json_clone_test(){
+    const char* text = "{\"s\":\"a string too long to be inline\",\"n\":[1,2.5,{\"k\":null}],\"o\":{\"t\":true},\"e\":{}}";
+    JsonObject* doc = json_parse_n(text,strlen(text),NULL);
+    Arena arena = {0};
+    JsonObject* copy = json_clone(doc,&arena);
+    char* original = json_stringify(doc);
+    char* cloned = json_stringify(copy);
+    assert(!strcmp(original,cloned));
+    //the copy shares nothing: editing it leaves doc as it was
+    assert(json_get(copy,"s")->str != json_get(doc,"s")->str);
+    json_set_field(json_get(copy,"o")->object,"t",json_value_boolean(false));
+    assert(json_get(json_get(doc,"o")->object,"t")->boolean);
+    json_free_object(copy);
+    arena_free(&arena);
+
+    //compacting owns one arena that json_free_object releases
+    json_compact(doc);
+    assert(doc->arena && buf_len(doc->arena->blocks) == 1);
+    buf_free(cloned);
+    cloned = json_stringify(doc);
+    assert(!strcmp(original,cloned));
+    assert(json_get(json_get(doc,"n")->values[2]->object,"k")->type == JSON_null);
+    buf_free(original);
+    buf_free(cloned);
+    json_free_object(doc);
+    free_json_data();
+}
+
+static void json_columns_assert_equal(const JsonColumns* a,const JsonColumns* b){
+    assert(a->rows == b->rows && a->columns_count == b->columns_count);
+    for (size_t c = 0; c < a->columns_count; c++){
+        const JsonColumn* x = a->columns + c;
+        const JsonColumn* y = b->columns + c;
+        for (size_t row = 0; row < a->rows; row++){
+            assert(json_column_valid(x,row) == json_column_valid(y,row));
+            switch (x->type) {
+                case JSON_number_int:
+                    assert(x->ints[row] == y->ints[row]);
+                    break;
+                case JSON_number_float:
+                    assert(x->floats[row] == y->floats[row]);
+                    break;
+                case JSON_bool:
+                    assert(x->bools[row] == y->bools[row]);
+                    break;
+                default: {
+                    JsonString sx = json_column_string(x,row);
+                    JsonString sy = json_column_string(y,row);
+                    assert(sx.len == sy.len && !memcmp(sx.str,sy.str,sx.len));
+                }
+            }
+        }
+    }
+}
+
+void json_columns_test(){
+    //integral doubles fit int columns, and a repeated key counts with its last value
+    const char* records = "[{\"id\":1,\"price\":2.5,\"ok\":true,\"name\":\"ab\"},"
+                          "{\"id\":2.0,\"price\":3,\"name\":null},"
+                          "{\"id\":1e3,\"price\":\"no\",\"ok\":false,\"name\":\"c\"},"
+                          "{\"id\":1.5},{\"id\":1e19},{\"id\":-9223372036854775808},"
+                          "{\"id\":5,\"id\":6,\"name\":\"first\",\"name\":\"last\"},"
+                          "{\"id\":7,\"id\":\"x\",\"ok\":true,\"ok\":1},"
+                          "{\"name\":\"x\",\"id\":9,\"name\":\"y\"},{}]";
+    JsonColumnSpec specs[] = {{"id",JSON_number_int},{"price",JSON_number_float},{"ok",JSON_bool},{"name",JSON_string}};
+    JsonColumns tokens;
+    json_columns_init(&tokens,specs,4);
+    assert(json_columns_decode(&tokens,records,strlen(records),NULL));
+    const JsonColumn* id = tokens.columns;
+    assert(tokens.rows == 10 && id->ints[1] == 2 && id->ints[2] == 1000 && id->ints[5] == INT64_MIN);
+    assert(!json_column_valid(id,3) && !json_column_valid(id,4) && id->ints[6] == 6 && !json_column_valid(id,7));
+    assert(!json_column_valid(tokens.columns + 2,7));
+    JsonString name = json_column_string(tokens.columns + 3,6);
+    assert(name.len == 4 && !memcmp(name.str,"last",4));
+    name = json_column_string(tokens.columns + 3,8);
+    assert(name.len == 1 && *name.str == 'y');
+
+    //the tree path agrees, with fields, with shapes and with lazy numbers
+    for (int mode = 0; mode < 3; mode++){
+        json_set_shared_shapes(mode == 1);
+        json_set_lazy_numbers(mode == 2);
+        BUF(char* text) = NULL;
+        buf_write(text,"{\"r\":",5);
+        buf_write(text,records,strlen(records));
+        buf_push(text,'}');
+        JsonObject* doc = json_parse_n(text,buf_len(text),NULL);
+        JsonValue* list = json_get(doc,"r");
+        JsonColumns tree;
+        json_columns_init(&tree,specs,4);
+        json_columns_prepare(&tree,list);
+        json_columns_fill(&tree,list,0,8);
+        json_columns_fill(&tree,list,8,tree.rows);
+        json_columns_assert_equal(&tokens,&tree);
+        json_columns_free(&tree);
+        json_free_object(doc);
+        buf_free(text);
+    }
+    json_set_shared_shapes(false);
+    json_set_lazy_numbers(false);
+    json_columns_free(&tokens);
+    json_free_shapes();
+    free_json_data();
+}
+
+void json_iteration_test(){
+    //the C++ iterators walk these contiguous arrays by index, whatever the layout
+    const char* text = "{\"a\":1,\"b\":[1,\"x\",true],\"c\":{\"d\":null},\"n\":[1.5,2]}";
+    const char* keys[] = {"a","b","c","n"};
+    for (int shared = 0; shared < 2; shared++){
+        json_set_shared_shapes(shared);
+        json_set_packed_arrays(shared);
+        JsonObject* obj = json_parse_n(text,strlen(text),NULL);
+        assert(obj->fields_count == 4 && (obj->shape != NULL) == shared);
+        for (size_t i = 0; i < obj->fields_count; i++){
+            JsonString key = json_object_key(obj,i);
+            assert(key.len == 1 && *key.str == *keys[i] && json_object_value(obj,i) == json_get(obj,keys[i]));
+        }
+        JsonArray b = json_get_array(json_object_value(obj,1));
+        assert(b.len == 3 && b.values[0]->type == JSON_number_int && b.values[2]->boolean);
+        JsonValue** end = b.values + b.len;
+        assert(end - b.values == 3 && end[-2]->type == JSON_string);
+        //numeric arrays are packed doubles when packing is on, boxed values otherwise
+        JsonValue* n = json_object_value(obj,3);
+        assert(n->type == (shared ? JSON_array_float : JSON_array) && n->len == 2);
+        assert(json_array_float_at(n,0) == 1.5 && json_array_float_at(n,1) == 2);
+        if (shared){
+            assert(n->floats[1] - n->floats[0] == 0.5);
+        }
+        json_free_object(obj);
+    }
+    json_set_shared_shapes(false);
+    json_set_packed_arrays(false);
+    json_free_shapes();
+    free_json_data();
+}
+
+void json_string_test(){
+    //escapes and UTF-8 decode to these bytes, read back as the value of "s"
+    static const struct{
+        const char* literal;
+        const char* bytes;
+        size_t len;
+    }valid[] = {
+        {"\"\\\"\\\\\\/\\b\\f\\n\\r\\t\"","\"\\/\b\f\n\r\t",8},
+        {"\"\\u00e9\\u20AC\"","\xc3\xa9\xe2\x82\xac",5},
+        {"\"\\ud83d\\ude00\"","\xf0\x9f\x98\x80",4},
+        {"\"a\\u0000b\"","a\0b",3},
+        {"\"caf\xc3\xa9 \xf0\x9f\x98\x80\"","caf\xc3\xa9 \xf0\x9f\x98\x80",10},
+        {"\"0123456789abcdef\xe2\x82\xac" "0123456789abcdef\"","0123456789abcdef\xe2\x82\xac" "0123456789abcdef",35},
+    };
+    //offsets count the {"s": prefix, so the literal's opening quote is at 5
+    static const struct{
+        const char* literal;
+        JsonErrorCode code;
+        size_t offset;
+    }invalid[] = {
+        {"\"\\ud83d\"",JSON_ERROR_STRING,12},
+        {"\"\\ude00\"",JSON_ERROR_STRING,6},
+        {"\"\\ud83d\\u0041\"",JSON_ERROR_STRING,12},
+        {"\"\\u12g4\"",JSON_ERROR_STRING,10},
+        {"\"\\x\"",JSON_ERROR_STRING,6},
+        {"\"a\nb\"",JSON_ERROR_STRING,7},
+        {"\"\xc0\xaf\"",JSON_ERROR_UTF8,6},
+        {"\"\xed\xa0\x80\"",JSON_ERROR_UTF8,6},
+        {"\"\xf4\x90\x80\x80\"",JSON_ERROR_UTF8,6},
+        {"\"\xe2\x82\"",JSON_ERROR_UTF8,6},
+        {"\"\x80\"",JSON_ERROR_UTF8,6},
+        {"\"0123456789abcdef\xff\"",JSON_ERROR_UTF8,22},
+    };
+    char text[128];
+    for (size_t i = 0; i < sizeof(valid)/sizeof(valid[0]); i++){
+        snprintf(text,sizeof(text),"{\"s\":%s}",valid[i].literal);
+        assert(json_validate(text,strlen(text),NULL));
+        JsonObject* obj = json_parse_n(text,strlen(text),NULL);
+        JsonString str = json_get_string(json_get(obj,"s"));
+        assert(str.len == valid[i].len && !memcmp(str.str,valid[i].bytes,str.len));
+        json_free_object(obj);
+    }
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++){
+        snprintf(text,sizeof(text),"{\"s\":%s}",invalid[i].literal);
+        JsonError parsed, validated;
+        assert(!json_parse_n(text,strlen(text),&parsed) && !json_validate(text,strlen(text),&validated));
+        assert(parsed.code == invalid[i].code && validated.code == invalid[i].code);
+        assert(parsed.offset == invalid[i].offset && validated.offset == invalid[i].offset);
+    }
+    free_json_data();
+}
+
+void json_literal_test(){
+    const char* text = "{\"t\":true,\"f\":false,\"n\":null,\"a\":[true,false,null],\"s\":\"true\"}";
+    JsonObject* obj = json_parse_n(text,strlen(text),NULL);
+    assert(json_get(obj,"t")->type == JSON_bool && json_get(obj,"t")->boolean);
+    assert(json_get(obj,"f")->type == JSON_bool && !json_get(obj,"f")->boolean);
+    assert(json_get(obj,"n")->type == JSON_null && json_get(obj,"s")->type == JSON_string);
+    JsonArray a = json_get_array(json_get(obj,"a"));
+    assert(a.len == 3 && a.values[0]->boolean && !a.values[1]->boolean && a.values[2]->type == JSON_null);
+    json_free_object(obj);
+
+    //a literal must be whole, lowercase and not run into a name; the input may end inside one
+    static const struct{
+        const char* text;
+        size_t len;
+    }invalid[] = {
+        {"{\"a\":tru}",9},
+        {"{\"a\":truex}",11},
+        {"{\"a\":True}",10},
+        {"{\"a\":null_}",11},
+        {"{\"a\":false1}",12},
+        {"{\"a\":nil}",9},
+        {"{\"a\":true}",8},
+        {"{\"a\":false}",9},
+    };
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++){
+        JsonError parsed, validated;
+        assert(!json_parse_n(invalid[i].text,invalid[i].len,&parsed));
+        assert(!json_validate(invalid[i].text,invalid[i].len,&validated));
+        assert(parsed.code == JSON_ERROR_UNEXPECTED_TOKEN && parsed.offset == 5);
+        assert(validated.code == parsed.code && validated.offset == parsed.offset);
+    }
+    free_json_data();
+}
+
+void json_lazy_number_test(){
+    const char* text = "{\"a\":12,\"b\":-0.5e2,\"c\":3.14159265358979323846264338327950288,"
+                       "\"d\":12345678901234567890,\"e\":[1,2.50]}";
+    json_set_lazy_numbers(true);
+    json_set_packed_arrays(true);
+    JsonObject* obj = json_parse_n(text,strlen(text),NULL);
+    JsonValue* b = json_get(obj,"b");
+    assert(json_get(obj,"a")->type == JSON_number_raw && b->type == JSON_number_raw);
+    assert(json_get_string(b).len == 6 && !memcmp(json_get_string(b).str,"-0.5e2",6));
+    assert(json_number_as_int64(json_get(obj,"a")) == 12 && json_number_as_double(b) == -50 && json_number_as_int(b) == -50);
+    assert(fabs(json_number_as_double(json_get(obj,"c")) - 3.141592653589793) < 1e-15);
+    //packing is off while numbers stay text, and printing writes the text back
+    assert(json_get(obj,"e")->type == JSON_array);
+    BUF(char* printed) = json_stringify(obj);
+    assert(!strcmp(printed,text));
+    buf_free(printed);
+    json_set_field(obj,"a",json_value_number_raw(json_string("1e2")));
+    assert(json_number_as_int64(json_get(obj,"a")) == 100);
+    json_free_object(obj);
+
+    //malformed numbers are still refused
+    JsonError error;
+    assert(!json_parse_n("{\"a\":01}",8,&error) && error.code == JSON_ERROR_NUMBER && error.offset == 6);
+    json_set_lazy_numbers(false);
+    json_set_packed_arrays(false);
+    obj = json_parse_n(text,strlen(text),NULL);
+    assert(json_get(obj,"a")->type == JSON_number_int && json_get(obj,"b")->type == JSON_number_float);
+    json_free_object(obj);
+    free_json_data();
+}
+
+void json_packed_array_test(){
+    const char* text = "{\"i\":[1,-2,9007199254740993],\"f\":[1,2.5,-3e2],\"m\":[1,\"x\",2],"
+                       "\"n\":[[1,2],[3.5]],\"e\":[],\"s\":[1,2,true]}";
+    json_set_packed_arrays(true);
+    JsonObject* obj = json_parse_n(text,strlen(text),NULL);
+    //integers stay exact past 2^53, one float turns the whole array into doubles
+    JsonValue* i = json_get(obj,"i");
+    assert(i->type == JSON_array_int && i->len == 3 && i->ints[1] == -2 && i->ints[2] == 9007199254740993LL);
+    JsonValue* f = json_get(obj,"f");
+    assert(f->type == JSON_array_float && f->len == 3 && f->floats[0] == 1 && f->floats[2] == -300);
+    assert(json_array_int_at(f,1) == 2 && json_array_float_at(i,0) == 1);
+    //anything but a number unpacks what was collected so far
+    JsonValue* m = json_get(obj,"m");
+    assert(m->type == JSON_array && m->len == 3 && m->values[0]->int_number == 1 && m->values[2]->int_number == 2);
+    assert(json_get(obj,"s")->type == JSON_array && json_get(obj,"s")->values[2]->type == JSON_bool);
+    JsonValue* n = json_get(obj,"n");
+    assert(n->type == JSON_array && n->values[0]->type == JSON_array_int && n->values[1]->type == JSON_array_float);
+    assert(json_get(obj,"e")->type == JSON_array && json_get(obj,"e")->len == 0);
+    BUF(char* printed) = json_stringify(obj);
+    assert(!strcmp(printed,"{\"i\":[1,-2,9007199254740993],\"f\":[1.0,2.5,-300.0],\"m\":[1,\"x\",2],"
+                           "\"n\":[[1,2],[3.5]],\"e\":[],\"s\":[1,2,true]}"));
+    buf_free(printed);
+    json_free_object(obj);
+
+    //built by hand, and read through the same accessors as boxed arrays
+    double floats[] = {0.5,-1};
+    int64_t ints[] = {INT64_MAX,3};
+    JsonValue* packed = json_value_array_float(floats,2);
+    assert(packed->type == JSON_array_float && packed->floats != floats && json_array_float_at(packed,1) == -1);
+    packed = json_value_array_int(ints,2);
+    assert(packed->type == JSON_array_int && json_array_int_at(packed,0) == INT64_MAX);
+    json_set_packed_arrays(false);
+    obj = json_parse_n(text,strlen(text),NULL);
+    assert(json_get(obj,"i")->type == JSON_array && json_array_int_at(json_get(obj,"f"),2) == -300);
+    json_free_object(obj);
+    free_json_data();
+}
+
+typedef struct FilterMatches{
+    const char* lines[8];
+    size_t count;
+    size_t limit;
+}FilterMatches;
+
+static bool filter_collect(const char* record,size_t len,void* user){
+    FilterMatches* matches = user;
+    (void)len;
+    matches->lines[matches->count++] = record;
+    return matches->count < matches->limit;
+}
+
+static bool filter_matches(JsonFilter* filter,const char* record){
+    return json_filter_match(filter,record,strlen(record));
+}
+
+void json_ndjson_filter_test(){
+    JsonFilter filter;
+    assert(json_filter_compile(&filter,"level == \"error\" && latency_ms > 500",NULL));
+    assert(buf_len(filter.terms) == 2 && filter.terms[1].op == JSON_FILTER_GT && filter.terms[1].number == 500);
+    assert(filter_matches(&filter,"{\"level\":\"error\",\"latency_ms\":900}"));
+    assert(filter_matches(&filter,"{\"msg\":\"a\\\"b\",\"nested\":{\"latency_ms\":1},\"latency_ms\":500.5,\"level\":\"error\"}"));
+    assert(!filter_matches(&filter,"{\"latency_ms\":900,\"level\":\"warn\"}"));
+    assert(!filter_matches(&filter,"{\"level\":\"error\",\"latency_ms\":500}"));
+    assert(!filter_matches(&filter,"{\"level\":\"error\",\"latency_ms\":\"900\"}"));
+    assert(!filter_matches(&filter,"{\"level\":\"error\"}"));
+    //a failing term decides the record, the rest of it is never read
+    assert(!filter_matches(&filter,"{\"level\":\"info\",\"latency_ms\":oops"));
+    assert(filter.records == 7 && filter.matches == 2 && filter.malformed == 0);
+    assert(!filter_matches(&filter,"{\"level\":\"error\" \"latency_ms\":900}") && filter.malformed == 1);
+    json_filter_free(&filter);
+
+    //lines are records: blank ones are skipped, malformed ones counted, and the callback can stop
+    const char* log = "{\"ok\":true,\"n\":null,\"s\":\"b\"}\n"
+                      "\n"
+                      "{\"ok\":true,\"n\":1,\"s\":\"a\"}\n"
+                      "{\"ok\":true,\"n\":\n"
+                      "{\"ok\":false}\n"
+                      "{\"s\":\"ab\",\"ok\":true,\"n\":[]}";
+    assert(json_filter_compile(&filter,"ok == true && n != null && \"s\" <= \"b\"",NULL));
+    FilterMatches matches = {{0},0,8};
+    assert(json_filter_ndjson(&filter,log,strlen(log),filter_collect,&matches) == 2);
+    assert(matches.lines[0] == strchr(log,'\n') + 2 && !strcmp(matches.lines[1],"{\"s\":\"ab\",\"ok\":true,\"n\":[]}"));
+    assert(filter.records == 5 && filter.matches == 2 && filter.malformed == 1);
+    matches = (FilterMatches){{0},0,1};
+    assert(json_filter_ndjson(&filter,log,strlen(log),filter_collect,&matches) == 1 && matches.count == 1);
+    json_filter_free(&filter);
+
+    static const struct{
+        const char* expr;
+        JsonErrorCode code;
+    }invalid[] = {
+        {"level = \"x\"",JSON_ERROR_UNEXPECTED_TOKEN},
+        {"ok > true",JSON_ERROR_TYPE},
+        {"a == 1 & b == 2",JSON_ERROR_UNEXPECTED_TOKEN},
+        {"a == 1 b == 2",JSON_ERROR_TRAILING},
+        {"a ==",JSON_ERROR_UNEXPECTED_EOF},
+        {"1 == a",JSON_ERROR_UNEXPECTED_TOKEN},
+    };
+    for (size_t i = 0; i < sizeof(invalid)/sizeof(invalid[0]); i++){
+        JsonError error;
+        assert(!json_filter_compile(&filter,invalid[i].expr,&error) && error.code == invalid[i].code);
+        assert(!filter.terms);
+    }
+}
+
+void json_small_string_test(){
+    assert(sizeof(JsonValue) == 16);
+    //up to JSON_SMALL_STRING - 1 bytes live in the value itself, NUL terminated
+    char text[] = "0123456789abcdef";
+    JsonValue* small = json_value_string_n(text,JSON_SMALL_STRING - 1);
+    JsonString str = json_get_string(small);
+    assert(small->small_len == JSON_SMALL_STRING && str.str == small->small && str.len == JSON_SMALL_STRING - 1);
+    assert(!memcmp(str.str,text,str.len) && str.str[str.len] == 0);
+    JsonValue* large = json_value_string_n(text,JSON_SMALL_STRING);
+    str = json_get_string(large);
+    assert(!large->small_len && str.str != text && str.len == JSON_SMALL_STRING && str.str[str.len] == 0);
+    //setting a string switches between the layouts
+    json_value_set_string(large,json_string("ok"));
+    assert(large->type == JSON_string && large->small_len == 3 && !strcmp(json_get_string(large).str,"ok"));
+    json_value_set_string(large,json_string(text));
+    assert(!large->small_len && json_get_string(large).str == text && json_get_string(large).len == 16);
+    json_value_set_string(large,(JsonString){0});
+    assert(!large->small_len && json_get_string(large).len == 0);
+
+    //parsed short strings, with escapes and embedded NULs, read and print the same
+    const char* json = "{\"cc\":\"CH\",\"q\":\"a\\\"b\",\"z\":\"a\\u0000b\",\"long\":\"0123456789abcdefgh\"}";
+    JsonObject* obj = json_parse_n(json,strlen(json),NULL);
+    assert(json_get(obj,"cc")->small_len == 3 && json_get(obj,"q")->small_len == 4);
+    str = json_get_string(json_get(obj,"z"));
+    assert(str.len == 3 && !memcmp(str.str,"a\0b",3) && !json_get(obj,"long")->small_len);
+    JsonObject* copy = json_clone(obj,NULL);
+    assert(json_get_string(json_get(copy,"cc")).str == json_get(copy,"cc")->small);
+    BUF(char* printed) = json_stringify(copy);
+    assert(!strcmp(printed,json));
+    buf_free(printed);
+    json_free_object(copy);
+    json_free_object(obj);
+    free_json_data();
+}
+
+void json_snapshot_test(){
+    JsonObject* obj = json_parse(read_file("./test.json"));
+#ifdef _WIN32
+    char path[L_tmpnam];
+    tmpnam(path);
+#else
+    char path[] = "/tmp/json_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+#endif
+    assert(json_snapshot_save(obj,path));
+
+    JsonSnapshot snapshot = json_snapshot_load(path);
+    const JsonSnapObject* root = json_snapshot_root(snapshot);
+    assert(root && root->fields_count == obj->fields_count);
+    assert(json_snap_get_field(root,"age")->value.int_number == 27);
+    assert(!strcmp(json_snap_string(&json_snap_get_field(root,"firstName")->value).str,"John"));
+    assert(!json_snap_get_field(root,"unknown"));
+    json_snapshot_close(&snapshot);
+    remove(path);
+
+    //a truncated image is refused even when its header claims the shorter size
+    BUF(char* image) = json_snapshot_write(obj);
+    for (size_t size = 0; size < buf_len(image); size++){
+        char* copy = xmalloc(size + 1);
+        memcpy(copy,image,size);
+        if (size >= sizeof(JsonSnapHeader)){
+            ((JsonSnapHeader*)copy)->size = size;
+        }
+        assert(!json_snapshot_open(copy,size).data);
+        free(copy);
+    }
+    //so is one with an offset pointing out of it
+    assert(json_snapshot_open(image,buf_len(image)).data);
+    JsonSnapValue* name = (JsonSnapValue*)&json_snap_get_field(json_snapshot_root(json_snapshot_open(image,buf_len(image))),"firstName")->value;
+    name->offset += buf_len(image);
+    assert(!json_snapshot_open(image,buf_len(image)).data);
+    buf_free(image);
+}
+
+
+void json_shape_test(){
+    json_set_shared_shapes(true);
+    JsonObject* obj = json_parse("{\"b\":1,\"a\":2,\"b\":3,\"list\":[{\"x\":1,\"y\":2},{\"x\":3,\"y\":4}]}");
+    assert(obj->shape && obj->fields_count == 4);
+    //duplicates: the latest wins for lookups, printing keeps every field
+    assert(json_get(obj,"b")->int_number == 3);
+    char* text = json_stringify(obj);
+    assert(!strcmp(text,"{\"b\":1,\"a\":2,\"b\":3,\"list\":[{\"x\":1,\"y\":2},{\"x\":3,\"y\":4}]}"));
+    buf_free(text);
+    JsonFormat sorted = {JSON_FORMAT_COMPACT,0,' ',true};
+    BUF(char* buffer) = json_stringify_format(NULL,obj,&sorted);
+    buf_push(buffer,0);
+    assert(!strcmp(buffer,"{\"a\":2,\"b\":1,\"b\":3,\"list\":[{\"x\":1,\"y\":2},{\"x\":3,\"y\":4}]}"));
+    buf_free(buffer);
+
+    //lookups, hits and misses alike, leave the object shared
+    JsonValue* list = json_get(obj,"list");
+    assert(list->values[0]->object->shape == list->values[1]->object->shape);
+    assert(!json_get(obj,"missing") && !json_get_field(obj,"missing") && obj->shape);
+
+    //a clone gets fields with its own keys, in its own arena
+    Arena arena = {0};
+    JsonObject* copy = json_clone(obj,&arena);
+    assert(!copy->shape && !json_get(copy,"list")->values[0]->object->shape);
+    json_set_field(copy,"a",json_value_number_int(5));
+    assert(json_get(copy,"a")->int_number == 5 && json_get(copy,"b")->int_number == 3);
+    assert(obj->shape && json_get(obj,"a")->int_number == 2);
+
+    //snapshots of shaped objects read the same as of unshared ones
+    BUF(char* image) = json_snapshot_write(obj);
+    JsonSnapshot snapshot = json_snapshot_open(image,buf_len(image));
+    const JsonSnapObject* root = json_snapshot_root(snapshot);
+    assert(root && root->fields_count == 4);
+    assert(json_snap_get_field(root,"b")->value.int_number == 3);
+    const JsonSnapArray* snap_list = json_snap_array(&json_snap_get_field(root,"list")->value);
+    assert(json_snap_get_field(json_snap_object(&snap_list->values[1]),"y")->value.int_number == 4);
+    buf_free(image);
+
+    //past JSON_SHAPE_MAX_TRANSITIONS children of a shape the parser falls back to fields
+    char many[64*32] = "{\"v\":[";
+    for (int i = 0; i < 40; i++){
+        size_t len = strlen(many);
+        snprintf(many + len,sizeof(many) - len,"%s{\"id\":%d,\"k%d\":%d}",i ? "," : "",i,i,i);
+    }
+    strcat(many,"]}");
+    JsonObject* doc = json_parse(many);
+    JsonValue* items = json_get(doc,"v");
+    for (int i = 0; i < 40; i++){
+        char key[16];
+        snprintf(key,sizeof(key),"k%d",i);
+        JsonObject* item = items->values[i]->object;
+        assert(json_get(item,"id")->int_number == i && json_get(item,key)->int_number == i);
+        assert(i < 32 ? item->shape != NULL : item->shape == NULL);
+    }
+
+    //as does an object unshared by an edit, so both outlive the shapes
+    JsonObject* edited = json_parse("{\"b\":1,\"a\":2,\"b\":3,\"list\":[]}");
+    assert(edited->shape == obj->shape);
+    json_set_field(edited,"a",json_value_number_int(6));
+    json_free_object(doc);
+    json_free_object(obj);
+    json_free_shapes();
+    assert(json_get(edited,"a")->int_number == 6 && json_get(edited,"b")->int_number == 3);
+    assert(!strcmp(edited->fields[1]->key.str,"a") && !strcmp(copy->fields[3]->key.str,"list"));
+    assert(json_get(json_get(copy,"list")->values[1]->object,"y")->int_number == 4);
+    json_free_object(edited);
+    json_free_object(copy);
+    arena_free(&arena);
+    free_json_data();
+    json_set_shared_shapes(false);
+}
+
+
+#include <pthread.h>
+
+typedef struct JsonStoreTest{
+    JsonStore store;
+    bool stop;
+    size_t reads;
+}JsonStoreTest;
+
+static void* json_store_test_reader(void* arg){
+    JsonStoreTest* test = arg;
+    JsonStoreReader* reader = json_store_reader(&test->store);
+    assert(reader);
+    size_t reads = 0;
+    while (!__atomic_load_n(&test->stop,__ATOMIC_RELAXED)){
+        JsonVersion* version = json_store_enter(&test->store,reader);
+        //every version is published whole: both counters and the list length agree
+        JsonObject* counters = json_get(version->root,"counters")->object;
+        int a = json_get(counters,"a")->int_number;
+        assert(a == json_get(counters,"b")->int_number);
+        assert(json_get(version->root,"list")->len == (uint32_t)(a % 5 + 1));
+        assert(!strcmp(json_get_string(json_get(version->root,"name")).str,"a name too long to be inline"));
+        json_store_leave(reader);
+        reads++;
+    }
+    json_store_reader_release(reader);
+    __atomic_fetch_add(&test->reads,reads,__ATOMIC_RELAXED);
+    return NULL;
+}
+
+void json_store_test(){
+    enum {READERS = 4, VERSIONS = 2000};
+    static JsonStoreTest test;
+    json_set_shared_shapes(true);
+    JsonObject* doc = json_parse("{\"name\":\"a name too long to be inline\",\"counters\":{\"a\":0,\"b\":0},\"list\":[0]}");
+    json_store_init(&test.store,doc);
+    //the store keeps its own copy, keys included, so the shapes can go
+    json_free_object(doc);
+    free_json_data();
+    json_free_shapes();
+
+    pthread_t readers[READERS];
+    for (int i = 0; i < READERS; i++){
+        pthread_create(readers + i,NULL,json_store_test_reader,&test);
+    }
+    const char* a[] = {"counters","a"};
+    const char* b[] = {"counters","b"};
+    const char* list[] = {"list",NULL};
+    bool rolled_over = false;
+    for (int i = 1; i < VERSIONS; i++){
+        JsonVersion* draft = json_store_edit(&test.store);
+        //past JSON_STORE_MAX_CHAIN shared versions the draft starts from a full copy
+        rolled_over |= i > 1 && !draft->base;
+        assert(draft->chain <= JSON_STORE_MAX_CHAIN);
+        assert(json_version_set(draft,a,2,json_value_number_int(i)));
+        assert(json_version_set(draft,b,2,json_value_number_int(i)));
+        char index[16];
+        if (i % 5){
+            snprintf(index,sizeof(index),"%d",i % 5);
+            list[1] = index;
+            assert(json_version_set(draft,list,2,json_value_number_int(i)));
+        }else{
+            JsonValue* one = json_value_array(NULL,0);
+            json_value_array_push(one,json_value_number_int(0));
+            assert(json_version_set(draft,list,1,one));
+            json_free_value(one);
+        }
+        json_store_publish(&test.store,draft);
+        free_json_data();
+    }
+    __atomic_store_n(&test.stop,true,__ATOMIC_RELAXED);
+    for (int i = 0; i < READERS; i++){
+        pthread_join(readers[i],NULL);
+    }
+    assert(rolled_over && test.reads);
+    json_store_reclaim(&test.store);
+    assert(!buf_len(test.store.retired));
+    char* text = json_stringify(test.store.current->root);
+    printf("%s\n",text);
+    buf_free(text);
+    json_store_free(&test.store);
+    json_set_shared_shapes(false);
+}
+
+
+static uint64_t fnv_hash(const char* str, size_t len){
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= str[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static double seconds_since(clock_t start){
+    return (double)(clock() - start)/CLOCKS_PER_SEC;
+}
+
+void str_hash_bench(){
+    enum {KEYS = 1 << 16, ROUNDS = 64, COLLIDING = 2048, MASK = 4*COLLIDING - 1};
+    char (*keys)[16] = xmalloc(KEYS*sizeof(*keys));
+    for (int i = 0; i < KEYS; i++){
+        snprintf(keys[i],sizeof(*keys),"key_%d",i);
+    }
+    char long_key[256];
+    memset(long_key,'x',sizeof(long_key));
+    uint64_t sink = 0;
+
+    clock_t start = clock();
+    for (int r = 0; r < ROUNDS; r++) for (int i = 0; i < KEYS; i++) sink ^= fnv_hash(keys[i],strlen(keys[i]));
+    printf("fnv-1a   short keys: %.1f Mhash/s\n",ROUNDS*KEYS/seconds_since(start)/1e6);
+    start = clock();
+    for (int r = 0; r < ROUNDS; r++) for (int i = 0; i < KEYS; i++) sink ^= str_hash(keys[i],strlen(keys[i]));
+    printf("str_hash short keys: %.1f Mhash/s\n",ROUNDS*KEYS/seconds_since(start)/1e6);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) sink ^= fnv_hash(long_key,sizeof(long_key) - (i & 7));
+    printf("fnv-1a   256B keys: %.2f GB/s\n",KEYS*sizeof(long_key)/seconds_since(start)/1e9);
+    start = clock();
+    for (int i = 0; i < KEYS; i++) sink ^= str_hash(long_key,sizeof(long_key) - (i & 7));
+    printf("str_hash 256B keys: %.2f GB/s\n",KEYS*sizeof(long_key)/seconds_since(start)/1e9);
+
+    JsonObject* obj = json_object(NULL,0);
+    for (int i = 0; i < KEYS; i++){
+        json_put_field(obj,json_field(keys[i],json_value_number_int(i)));
+    }
+    start = clock();
+    for (int r = 0; r < ROUNDS; r++) for (int i = 0; i < KEYS; i++) sink ^= (uintptr_t)json_get_field(obj,keys[i]);
+    printf("json_get_field: %.1f Mlookups/s\n",ROUNDS*KEYS/seconds_since(start)/1e6);
+
+    // Adversarial set: keys whose FNV-1a hashes all share the low bits an
+    // index of this size probes with, which used to degrade it to a list.
+    char (*colliding)[16] = xmalloc(COLLIDING*sizeof(*colliding));
+    int found = 0;
+    for (uint32_t n = 0; found < COLLIDING; n++){
+        char key[16];
+        int len = snprintf(key,sizeof(key),"k%u",n);
+        if (((fnv_hash(key,len) | 1) & MASK) == 1){
+            memcpy(colliding[found++],key,sizeof(key));
+        }
+    }
+    JsonObject* attacked = json_object(NULL,0);
+    start = clock();
+    for (int i = 0; i < COLLIDING; i++){
+        json_put_field(attacked,json_field(colliding[i],json_value_null()));
+    }
+    for (int r = 0; r < ROUNDS; r++) for (int i = 0; i < COLLIDING; i++) sink ^= (uintptr_t)json_get_field(attacked,colliding[i]);
+    printf("fnv-colliding keys: %.1f Mlookups/s (%d keys)\n",ROUNDS*COLLIDING/seconds_since(start)/1e6,COLLIDING);
+    printf("(checksum %llu)\n",(unsigned long long)(sink & 1));
+    free(keys);
+    free(colliding);
+}